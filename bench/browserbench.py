@@ -0,0 +1,275 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+# Loads the stress pages in bench/pages into 1, 4 and 12 CEFnodes for a fixed
+# time each and reports frame rate, CPU and upload numbers as JSON or CSV.
+# Must be run from the directory containing avg_cefhelper and
+# avg_cefplugin.ini, like src/test/testapp.py.
+#
+#   mypy bench/browserbench.py --format csv --output result.csv
+#   mypy bench/browserbench.py --baseline last.json --tolerance 0.1
+#
+# With --baseline, exits with 1 if any scenario got slower than the baseline
+# by more than the tolerance, so upgrades can be gated on it.
+
+from __future__ import print_function
+
+import argparse
+import csv
+import json
+import math
+import os
+import sys
+import time
+
+from libavg import app, player
+import libavg
+
+libavg.logger.configureCategory( "PLUGIN", 30 )
+
+BENCH_DIR = os.path.dirname( os.path.abspath( __file__ ) )
+PAGE_DIR = os.path.join( BENCH_DIR, "pages" )
+
+# Page and whether its node is transparent.
+PAGES = [
+    ( "css_animation", False ),
+    ( "canvas2d", False ),
+    ( "video", False ),
+    ( "long_scroll", False ),
+    ( "dom_updates", False ),
+    ( "transparent_overlay", True ),
+]
+NODE_COUNTS = [ 1, 4, 12 ]
+
+# Node counters summed over all nodes of a scenario.
+COUNTERS = [
+    ( "framesSkipped", "frames_skipped" ),
+    ( "lateFrames", "late_frames" ),
+    ( "uploadBytesSaved", "upload_bytes_saved" ),
+    ( "reportedDirtyBytes", "reported_dirty_bytes" ),
+    ( "changedDirtyBytes", "changed_dirty_bytes" ),
+]
+
+# Node stats summed over all nodes of a scenario.
+STATS = [
+    ( "paints", "paints" ),
+    ( "dirtyPixels", "dirty_pixels" ),
+    ( "copiedBytes", "copied_bytes" ),
+    ( "uploadedBytes", "uploaded_bytes" ),
+    ( "messagesPerSecond", "messages_per_second" ),
+]
+
+# Result fields compared against a baseline, and whether higher is better.
+GATED = [ ( "fps", True ), ( "cpu_percent_per_node", False ) ]
+
+
+def parseArgs():
+    parser = argparse.ArgumentParser( description="CEFnode benchmark" )
+    parser.add_argument( "--duration", type=float, default=10.0,
+        help="Seconds measured per scenario." )
+    parser.add_argument( "--warmup", type=float, default=3.0,
+        help="Seconds waited after loading before measuring." )
+    parser.add_argument( "--pages", default=",".join( p[0] for p in PAGES ),
+        help="Comma separated list of pages to run." )
+    parser.add_argument( "--nodes", default=",".join( str( n ) for n in NODE_COUNTS ),
+        help="Comma separated list of node counts." )
+    parser.add_argument( "--resolution", default="1920x1080" )
+    parser.add_argument( "--format", choices=[ "json", "csv" ], default="json" )
+    parser.add_argument( "--output", default="-",
+        help="Report file, - for stdout." )
+    parser.add_argument( "--baseline",
+        help="JSON report of an earlier run to compare against." )
+    parser.add_argument( "--tolerance", type=float, default=0.1,
+        help="Allowed relative regression against the baseline." )
+    return parser.parse_args()
+
+
+def cpuSeconds():
+    """CPU time of this process and all its descendants, which includes
+    CEF's renderer and GPU processes. Linux only, elsewhere just us."""
+    if not os.path.isdir( "/proc" ):
+        times = os.times()
+        return times[0] + times[1]
+
+    ticks = float( os.sysconf( "SC_CLK_TCK" ) )
+    children = {}
+    usage = {}
+    for entry in os.listdir( "/proc" ):
+        if not entry.isdigit():
+            continue
+        try:
+            with open( "/proc/%s/stat" % entry ) as f:
+                stat = f.read()
+        except IOError:
+            continue
+        # The command may contain spaces, fields start after its ')'.
+        fields = stat[stat.rfind( ")" ) + 2:].split()
+        pid = int( entry )
+        children.setdefault( int( fields[1] ), [] ).append( pid )
+        usage[pid] = ( int( fields[11] ) + int( fields[12] ) ) / ticks
+
+    total = 0.0
+    pending = [ os.getpid() ]
+    while pending:
+        pid = pending.pop()
+        total += usage.get( pid, 0.0 )
+        pending.extend( children.get( pid, [] ) )
+    return total
+
+
+def percentile( values, p ):
+    if not values:
+        return 0.0
+    values = sorted( values )
+    index = min( int( math.ceil( p * len( values ) ) ) - 1, len( values ) - 1 )
+    return values[max( index, 0 )]
+
+
+def gridRects( count, size ):
+    columns = int( math.ceil( math.sqrt( count ) ) )
+    rows = int( math.ceil( count / float( columns ) ) )
+    cell = libavg.Point2D( size.x / columns, size.y / rows )
+    for i in range( count ):
+        pos = libavg.Point2D( ( i % columns ) * cell.x, ( i // columns ) * cell.y )
+        yield pos, cell
+
+
+class BenchDiv( app.MainDiv ):
+    def onInit( self ):
+        player.loadPlugin( "libavg_cefplugin" )
+
+        self.args = ARGS
+        pages = dict( PAGES )
+        self.scenarios = [ ( page, pages[page], int( count ) )
+            for page in self.args.pages.split( "," )
+            for count in self.args.nodes.split( "," ) ]
+        self.results = []
+        self.nodes = []
+        self.measuring = False
+        self.startScenario()
+
+    def startScenario( self ):
+        page, transparent, count = self.scenarios[len( self.results )]
+        url = "file://" + os.path.join( PAGE_DIR, page + ".html" )
+        for pos, size in gridRects( count, self.size ):
+            node = libavg_cefplugin.CEFnode( pos=pos, size=size,
+                transparent=transparent, parent=self )
+            node.addJSCallback( "bench_tick", self.onTick )
+            node.loadURL( url )
+            self.nodes.append( node )
+        player.setTimeout( int( self.args.warmup * 1000 ), self.startMeasuring )
+
+    def startMeasuring( self ):
+        self.frameTimes = []
+        self.latencies = []
+        self.counters = self.readCounters()
+        for node in self.nodes:
+            node.resetStats()
+        self.cpuStart = cpuSeconds()
+        self.timeStart = time.time()
+        self.measuring = True
+        player.setTimeout( int( self.args.duration * 1000 ), self.stopMeasuring )
+
+    def stopMeasuring( self ):
+        self.measuring = False
+        elapsed = time.time() - self.timeStart
+        cpu = cpuSeconds() - self.cpuStart
+        counters = self.readCounters()
+        stats = [ node.stats for node in self.nodes ]
+
+        page, transparent, count = self.scenarios[len( self.results )]
+        result = {
+            "page": page,
+            "nodes": count,
+            "duration_s": round( elapsed, 3 ),
+            "fps": round( len( self.frameTimes ) / elapsed, 2 ),
+            "frame_time_p50_ms": percentile( self.frameTimes, 0.5 ),
+            "frame_time_p95_ms": percentile( self.frameTimes, 0.95 ),
+            "frame_time_max_ms": max( self.frameTimes or [ 0 ] ),
+            "cpu_percent_per_node": round( cpu / elapsed / count * 100.0, 2 ),
+            "message_latency_p50_ms": percentile( self.latencies, 0.5 ),
+            "message_latency_p95_ms": percentile( self.latencies, 0.95 ),
+        }
+        for prop, key in COUNTERS:
+            result[key] = counters[prop] - self.counters[prop]
+        for prop, key in STATS:
+            result[key] = sum( s[prop] for s in stats )
+        # Per node percentiles can't be merged, report typical and worst.
+        result["paint_latency_p50_ms"] = sum( s["latencyP50"] for s in stats ) / count
+        result["paint_latency_p95_ms"] = max( s["latencyP95"] for s in stats )
+        self.results.append( result )
+        print( "%-20s %2d nodes %6.1f fps %6.1f%% cpu/node" % ( page, count,
+            result["fps"], result["cpu_percent_per_node"] ), file=sys.stderr )
+
+        for node in self.nodes:
+            node.unlink( True )
+        self.nodes = []
+
+        if len( self.results ) < len( self.scenarios ):
+            self.startScenario()
+        else:
+            player.stop()
+
+    def readCounters( self ):
+        # Cumulative node properties, unaffected by resetStats().
+        return dict( ( prop, sum( getattr( node, prop ) for node in self.nodes ) )
+            for prop, key in COUNTERS )
+
+    def onTick( self, data ):
+        if self.measuring:
+            self.latencies.append( max( time.time() * 1000.0 - float( data ), 0.0 ) )
+
+    def onFrame( self ):
+        if self.measuring:
+            self.frameTimes.append( player.getFrameDuration() )
+
+    def onExit( self ):
+        libavg_cefplugin.CEFnode.cleanup()
+
+
+def writeReport( results, args ):
+    out = sys.stdout if args.output == "-" else open( args.output, "w" )
+    if args.format == "json":
+        json.dump( { "timestamp": int( time.time() ), "args": vars( args ),
+            "results": results }, out, indent=2, sort_keys=True )
+        out.write( "\n" )
+    else:
+        writer = csv.DictWriter( out, fieldnames=sorted( results[0].keys() ) )
+        writer.writeheader()
+        writer.writerows( results )
+    if out is not sys.stdout:
+        out.close()
+
+
+def compareBaseline( results, args ):
+    with open( args.baseline ) as f:
+        baseline = dict( ( ( r["page"], r["nodes"] ), r )
+            for r in json.load( f )["results"] )
+
+    regressions = 0
+    for result in results:
+        old = baseline.get( ( result["page"], result["nodes"] ) )
+        if not old:
+            continue
+        for key, higherIsBetter in GATED:
+            if old[key] <= 0:
+                continue
+            change = ( result[key] - old[key] ) / float( old[key] )
+            if ( -change if higherIsBetter else change ) > args.tolerance:
+                print( "REGRESSION %s %d nodes: %s %s -> %s" % ( result["page"],
+                    result["nodes"], key, old[key], result[key] ), file=sys.stderr )
+                regressions += 1
+    return regressions
+
+
+ARGS = parseArgs()
+# libavg's app parses argv too and doesn't know our options.
+sys.argv = sys.argv[:1]
+
+mainDiv = BenchDiv()
+app.App().run( mainDiv, app_resolution=ARGS.resolution )
+
+if len( mainDiv.results ) > 0:
+    writeReport( mainDiv.results, ARGS )
+if ARGS.baseline and compareBaseline( mainDiv.results, ARGS ) > 0:
+    sys.exit( 1 )
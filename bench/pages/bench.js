@@ -0,0 +1,25 @@
+// Shared by all stress pages. Pages must behave the same on every run, so
+// randomness comes from a fixed seed and animation from frame counts.
+
+var bench = {};
+
+bench.seed = 12345;
+bench.random = function()
+{
+    // Park-Miller, good enough and identical everywhere.
+    bench.seed = ( bench.seed * 16807 ) % 2147483647;
+    return ( bench.seed - 1 ) / 2147483646;
+};
+
+// Reports the wall clock every 250ms, so the runner can measure how long
+// a message takes to reach Python.
+bench.startTicks = function()
+{
+    setInterval( function()
+    {
+        if( window.avg )
+            avg.send( 'bench_tick', String( Date.now() ) );
+    }, 250 );
+};
+
+window.addEventListener( 'load', bench.startTicks );
@@ -0,0 +1,175 @@
+// Throughput of the pixel kernels and the tile hash at every level the
+// CPU supports. Checks first that all levels give the same result as the
+// scalar code.
+//
+// Usage: pixelkernels_bench [width height [iterations]]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "pixelkernels.h"
+
+using namespace avg;
+
+typedef std::chrono::steady_clock Clock;
+
+// Premultiplied pixels, opaquefraction of them with alpha 255.
+static void Fill( std::vector< unsigned char >& pixels, float opaquefraction )
+{
+	std::mt19937 rng( 42 );
+	std::uniform_real_distribution< float > chance( 0.0f, 1.0f );
+	for( size_t i = 0; i < pixels.size(); i += 4 )
+	{
+		int a = chance( rng ) < opaquefraction ? 255 : (int)( rng() % 256 );
+		for( int c = 0; c < 3; ++c )
+			pixels[i + c] = (unsigned char)( a ? rng() % ( a + 1 ) : 0 );
+		pixels[i + 3] = (unsigned char)a;
+	}
+}
+
+static bool Verify( int count )
+{
+	std::vector< unsigned char > src( count * 4 );
+	Fill( src, 0.5f );
+	// Odd offsets and lengths to cover the scalar tails.
+	const int offset = 3;
+	int n = count - offset - 5;
+
+	const char* names[] = { "premultiply", "unpremultiply", "swizzle" };
+	PixelKernels::RowFunc funcs[] = { PixelKernels::Premultiply,
+		PixelKernels::Unpremultiply, PixelKernels::SwizzleRB };
+
+	bool ok = true;
+	for( int f = 0; f < 3; ++f )
+	{
+		std::vector< unsigned char > expected( count * 4, 0 );
+		PixelKernels::SetLevel( PixelKernels::SCALAR );
+		funcs[f]( &src[offset * 4], &expected[offset * 4], n );
+		bool opaque = PixelKernels::IsOpaque( &src[offset * 4], n );
+
+		for( int l = PixelKernels::SSE2; l <= PixelKernels::GetSupportedLevel(); ++l )
+		{
+			PixelKernels::Level level = (PixelKernels::Level)l;
+			PixelKernels::SetLevel( level );
+			std::vector< unsigned char > result( count * 4, 0 );
+			funcs[f]( &src[offset * 4], &result[offset * 4], n );
+			if( result != expected ||
+				PixelKernels::IsOpaque( &src[offset * 4], n ) != opaque )
+			{
+				printf( "MISMATCH: %s %s\n", names[f],
+					PixelKernels::GetLevelName( level ) );
+				ok = false;
+			}
+		}
+	}
+
+	unsigned long long expected[2] = { 0, 0 };
+	PixelKernels::SetLevel( PixelKernels::SCALAR );
+	PixelKernels::HashAccumulate( &src[offset * 4], n, 7, expected );
+	for( int l = PixelKernels::SSE2; l <= PixelKernels::GetSupportedLevel(); ++l )
+	{
+		PixelKernels::Level level = (PixelKernels::Level)l;
+		PixelKernels::SetLevel( level );
+		unsigned long long result[2] = { 0, 0 };
+		PixelKernels::HashAccumulate( &src[offset * 4], n, 7, result );
+		if( PixelKernels::HashFinish( result ) != PixelKernels::HashFinish( expected ) )
+		{
+			printf( "MISMATCH: hash %s\n", PixelKernels::GetLevelName( level ) );
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+static double Measure( PixelKernels::RowFunc func,
+	const std::vector< unsigned char >& src, std::vector< unsigned char >& dst,
+	int width, int height, int iterations )
+{
+	Clock::time_point start = Clock::now();
+	for( int i = 0; i < iterations; ++i )
+	{
+		for( int y = 0; y < height; ++y )
+			func( &src[y * width * 4], &dst[y * width * 4], width );
+	}
+	std::chrono::duration< double > secs = Clock::now() - start;
+	return (double)width * height * iterations / secs.count() / 1e6;
+}
+
+static void MemcpyRow( const unsigned char* src, unsigned char* dst, int count )
+{
+	memcpy( dst, src, count * 4 );
+}
+
+static volatile bool s_Sink;
+static volatile unsigned long long s_HashSink;
+
+static void IsOpaqueRow( const unsigned char* src, unsigned char*, int count )
+{
+	s_Sink = PixelKernels::IsOpaque( src, count );
+}
+
+static void HashRow( const unsigned char* src, unsigned char*, int count )
+{
+	unsigned long long acc[2] = { 0, 0 };
+	PixelKernels::HashAccumulate( src, count, 0, acc );
+	s_HashSink = PixelKernels::HashFinish( acc );
+}
+
+int main( int argc, char** argv )
+{
+	int width = argc > 2 ? atoi( argv[1] ) : 1920;
+	int height = argc > 2 ? atoi( argv[2] ) : 1080;
+	int iterations = argc > 3 ? atoi( argv[3] ) : 50;
+
+	printf( "Supported level: %s\n",
+		PixelKernels::GetLevelName( PixelKernels::GetSupportedLevel() ) );
+	if( !Verify( 4099 ) )
+		return 1;
+	printf( "All levels match scalar.\n" );
+	printf( "%dx%d, %d iterations, Mpixel/s:\n\n", width, height, iterations );
+
+	std::vector< unsigned char > mixed( width * height * 4 );
+	std::vector< unsigned char > opaque( width * height * 4 );
+	std::vector< unsigned char > dst( width * height * 4 );
+	Fill( mixed, 0.5f );
+	Fill( opaque, 1.0f );
+
+	struct Case
+	{
+		const char* mName;
+		PixelKernels::RowFunc mFunc;
+		const std::vector< unsigned char >* mSrc;
+	};
+	Case cases[] =
+	{
+		{ "unpremultiply (50% opaque)", PixelKernels::Unpremultiply, &mixed },
+		{ "unpremultiply (opaque)", PixelKernels::Unpremultiply, &opaque },
+		{ "premultiply", PixelKernels::Premultiply, &mixed },
+		{ "swizzle", PixelKernels::SwizzleRB, &mixed },
+		{ "isopaque", IsOpaqueRow, &opaque },
+		{ "hash", HashRow, &mixed },
+	};
+
+	printf( "%-28s", "" );
+	for( int l = 0; l <= PixelKernels::GetSupportedLevel(); ++l )
+		printf( "%10s", PixelKernels::GetLevelName( (PixelKernels::Level)l ) );
+	printf( "\n%-28s%10.0f\n", "memcpy",
+		Measure( MemcpyRow, mixed, dst, width, height, iterations ) );
+
+	for( size_t c = 0; c < sizeof( cases ) / sizeof( cases[0] ); ++c )
+	{
+		printf( "%-28s", cases[c].mName );
+		for( int l = 0; l <= PixelKernels::GetSupportedLevel(); ++l )
+		{
+			PixelKernels::SetLevel( (PixelKernels::Level)l );
+			printf( "%10.0f", Measure( cases[c].mFunc, *cases[c].mSrc, dst,
+				width, height, iterations ) );
+		}
+		printf( "\n" );
+	}
+	return 0;
+}
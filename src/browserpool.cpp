@@ -0,0 +1,99 @@
+#include "browserpool.h"
+
+#include <algorithm>
+
+#include "messagepump.h"
+
+namespace avg
+{
+
+// Frame rate of idle browsers. They are hidden, so it only limits the
+// blank page's paints.
+static const int IDLE_FRAME_RATE = 1;
+
+BrowserPool::BrowserPool()
+	: mCount( 0 ), mSize( 0, 0 ), mExternalBeginFrame( false ),
+	mMultiThreaded( false ), mPrewarm( 0 ),
+	mPrewarmTransparent( 0 ), mHits( 0 ), mMisses( 0 )
+{}
+
+BrowserPool& BrowserPool::Get()
+{
+	static BrowserPool pool;
+	return pool;
+}
+
+void BrowserPool::Configure( int count, int transparent, glm::uvec2 size,
+	bool externalbeginframe, bool multithreaded )
+{
+	mCount = count;
+	mSize = size;
+	mExternalBeginFrame = externalbeginframe;
+	mMultiThreaded = multithreaded;
+	mPrewarm = count;
+	mPrewarmTransparent = std::min( transparent, count );
+	if( mCount > 0 )
+		MessagePump::Get().AddClient( this );
+}
+
+CefRefPtr< CEFWrapper > BrowserPool::Take( bool transparent )
+{
+	if( mCount <= 0 )
+		return nullptr;
+
+	for( auto i = mIdle.begin(); i != mIdle.end(); ++i )
+	{
+		if( i->mTransparent != transparent || !i->mWrapper->IsBlank() )
+			continue;
+
+		CefRefPtr< CEFWrapper > wrapper = i->mWrapper;
+		mIdle.erase( i );
+		wrapper->SetHidden( false );
+		wrapper->ResetStats();
+		++mHits;
+		return wrapper;
+	}
+	++mMisses;
+	return nullptr;
+}
+
+void BrowserPool::Return( CefRefPtr< CEFWrapper > wrapper )
+{
+	wrapper->Recycle();
+	Entry entry = { wrapper, wrapper->GetTransparent() };
+	mIdle.push_back( entry );
+}
+
+void BrowserPool::Clear()
+{
+	for( auto i = mIdle.begin(); i != mIdle.end(); ++i )
+		i->mWrapper->Close();
+	mIdle.clear();
+	mPrewarm = 0;
+	mPrewarmTransparent = 0;
+	if( mCount > 0 )
+		MessagePump::Get().RemoveClient( this );
+	mCount = 0;
+}
+
+void BrowserPool::onPreRender()
+{
+	// One at a time, creating browsers blocks the frame.
+	if( mPrewarm > 0 && !IsFull() )
+	{
+		--mPrewarm;
+		bool transparent = mPrewarmTransparent > 0;
+		if( transparent )
+			--mPrewarmTransparent;
+		CefRefPtr< CEFWrapper > wrapper = new CEFWrapper();
+		wrapper->Init( mSize, transparent, IDLE_FRAME_RATE, mExternalBeginFrame,
+			mMultiThreaded );
+		Return( wrapper );
+	}
+
+	// Picks up their callbacks and paints like CEFNode does for its own.
+	for( auto i = mIdle.begin(); i != mIdle.end(); ++i )
+		i->mWrapper->Update();
+}
+
+} // namespace avg
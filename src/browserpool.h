@@ -0,0 +1,77 @@
+#ifndef BROWSERPOOL_H
+#define BROWSERPOOL_H
+
+#include <vector>
+
+#include <base/IPreRenderListener.h>
+#include <glm/glm.hpp>
+
+#include "cefwrapper.h"
+
+namespace avg
+{
+
+/*! \brief Process-wide pool of idle browsers. The configured number is
+ * created ahead of time on a blank page, one per frame, so connecting
+ * nodes skip browser and renderer process startup. Disconnected nodes
+ * give their browser back instead of closing it while there is room.
+ * Idle browsers are hidden and updated every frame through MessagePump.
+ * Only used from the main thread. */
+class BrowserPool : public IPreRenderListener
+{
+public:
+	static BrowserPool& Get();
+
+	/*! \brief Sets how many idle browsers are kept, how many of the
+	 * pre-created ones are transparent and the view size they start
+	 * with. 0 disables the pool. The remaining parameters are passed to
+	 * CEFWrapper::Init. */
+	void Configure( int count, int transparent, glm::uvec2 size,
+		bool externalbeginframe, bool multithreaded );
+
+	/*! \brief Returns an idle browser of the given transparency that
+	 * finished loading its blank page, or null. Counts hits and misses
+	 * while the pool is enabled. */
+	CefRefPtr< CEFWrapper > Take( bool transparent );
+
+	/*! \brief Whether Return() would close instead of keeping. */
+	bool IsFull() const { return (int)mIdle.size() >= mCount; }
+	/*! \brief Resets wrapper to a blank page and keeps it. Callbacks of
+	 * the node must have been taken out before. */
+	void Return( CefRefPtr< CEFWrapper > wrapper );
+
+	/*! \brief Closes all idle browsers. Must happen before CefShutdown. */
+	void Clear();
+
+	int GetHits() const { return mHits; }
+	int GetMisses() const { return mMisses; }
+	int GetIdle() const { return (int)mIdle.size(); }
+
+	// IPreRenderListener, called by MessagePump
+	void onPreRender();
+
+private:
+	struct Entry
+	{
+		CefRefPtr< CEFWrapper > mWrapper;
+		bool mTransparent;
+	};
+
+	BrowserPool();
+
+	std::vector< Entry > mIdle;
+	int mCount;
+	glm::uvec2 mSize;
+	bool mExternalBeginFrame;
+	bool mMultiThreaded;
+	// Browsers still to create ahead of time, the first
+	// mPrewarmTransparent of them transparent.
+	int mPrewarm;
+	int mPrewarmTransparent;
+	int mHits;
+	int mMisses;
+};
+
+} // namespace avg
+
+#endif
@@ -1,5 +1,7 @@
 #include "cefplugin.h"
 
+#include <algorithm>
+#include <cstdio>
 #include <exception>
 
 using namespace boost::python;
@@ -10,12 +12,31 @@ namespace avg
 bool CEFNode::g_AudioMuted;
 INI::Level CEFNode::g_AdditionalArguments;
 uint16_t CEFNode::g_DebuggerPort;
+int CEFNode::g_PBOBuffers;
+int CEFNode::g_CopyThreads;
+int CEFNode::g_ResizeInterval;
+int CEFNode::g_PoolTextures;
+int CEFNode::g_PoolBitmaps;
+int CEFNode::g_PoolBrowsers;
+int CEFNode::g_PoolTransparentBrowsers;
+glm::uvec2 CEFNode::g_PoolBrowserSize;
+bool CEFNode::g_ExternalBeginFrame;
+int CEFNode::g_PumpBudget;
+int CEFNode::g_DispatchBudget;
+bool CEFNode::g_MultiThreadedLoop;
 
 ///*****************************************************************************
 /// CEFNode
 CEFNode::CEFNode(const ArgList& Args)
 	: RasterNode( "Node" ),
-	m_Transparent( false ), m_MouseInput( false ), m_InitScrollbarsEnabled( true )
+	m_Capacity( 0, 0 ), m_TileSize( 0 ), m_BackingTileSize( 0 ),
+	m_TileFXWarned( false ),
+	m_UploadedGeneration( 0 ), m_FramesSkipped( 0 ), m_StatsFramesSkipped( 0 ),
+	m_Transparent( false ), m_MouseInput( false ), m_TouchInput( false ),
+	m_FrameRate( 60 ),
+	m_AdaptiveFrameRate( false ), m_TileDiff( false ), m_AutoHide( true ),
+	m_PreRendered( false ),
+	m_Shown( false ), m_InitScrollbarsEnabled( true )
 {
 	ObjectCounter::get()->incRef(&typeid(*this));
 	Args.setMembers( this );
@@ -26,6 +47,7 @@ CEFNode::CEFNode(const ArgList& Args)
 CEFNode::~CEFNode()
 {
 	ObjectCounter::get()->decRef(&typeid(*this));
+	mWrapper->ClearCallbacks();
 }
 
 void CEFNode::connectDisplay()
@@ -36,22 +58,168 @@ void CEFNode::connectDisplay()
 
 void CEFNode::connect(CanvasPtr canvas)
 {
-	mWrapper->Init( glm::uvec2(getWidth(), getHeight()), m_Transparent );
+	glm::uvec2 size( getWidth(), getHeight() );
+	CefRefPtr< CEFWrapper > pooled = BrowserPool::Get().Take( m_Transparent );
+	if( pooled )
+	{
+		// Keeps the callbacks set before the node was connected.
+		pooled->TakeCallbacks( *mWrapper );
+		mWrapper = pooled;
+		mWrapper->Resize( size, size );
+		mWrapper->SetFrameRate( m_FrameRate );
+	}
+	else
+	{
+		mWrapper->Init( size, m_Transparent, m_FrameRate, g_ExternalBeginFrame,
+			g_MultiThreadedLoop );
+	}
+	m_FrameRate = mWrapper->GetFrameRate();
 
 	setScrollbarsEnabled( m_InitScrollbarsEnabled );
 	setVolume( m_InitVolume );
 
 	setMouseInput( m_MouseInput );
-
-	Player::get()->registerPreRenderListener( this );
+	setTouchInput( m_TouchInput );
+	mWrapper->SetStreamingUpload( g_PBOBuffers );
+	mWrapper->SetResizeInterval( g_ResizeInterval );
+	mWrapper->SetAdaptiveFrameRate( m_AdaptiveFrameRate );
+	mWrapper->SetTileDiff( m_TileDiff );
+	// Assume shown until the first frame says otherwise.
+	m_PreRendered = true;
+	m_Shown = true;
+
+	MessagePump::Get().AddClient( this );
 	RasterNode::connect(canvas);
 }
 
 void CEFNode::disconnect(bool kill)
 {
-	Player::get()->unregisterPreRenderListener( this );
-	mWrapper->Close();
+	MessagePump::Get().RemoveClient( this );
+	if( BrowserPool::Get().IsFull() )
+	{
+		mWrapper->Close();
+	}
+	else
+	{
+		// The browser goes back to the pool, the callbacks stay with us.
+		CefRefPtr< CEFWrapper > fresh = new CEFWrapper();
+		fresh->TakeCallbacks( *mWrapper );
+		BrowserPool::Get().Return( mWrapper );
+		mWrapper = fresh;
+	}
 	RasterNode::disconnect(kill);
+
+	releaseTextures();
+	m_SurfaceCreated = false;
+}
+
+void CEFNode::releaseTextures()
+{
+	SurfacePool::Get().ReleaseTexture( m_pTexture );
+	m_pTexture.reset();
+	for (auto i = m_Tiles.begin(); i != m_Tiles.end(); ++i)
+		SurfacePool::Get().ReleaseTexture( *i );
+	m_Tiles.clear();
+	for (auto i = m_TileSurfaces.begin(); i != m_TileSurfaces.end(); ++i)
+		delete *i;
+	m_TileSurfaces.clear();
+	m_TileQuads.clear();
+	m_BackingTileSize = 0;
+}
+
+// Spare room given to the texture when a node grows past its capacity,
+// so size animations don't reallocate every frame.
+static const float CAPACITY_GROWTH = 1.25f;
+static const int CAPACITY_ALIGN = 64;
+
+IntPoint CEFNode::calcCapacity(const IntPoint& size) const
+{
+	// Effects render the whole texture, so they need an exact fit.
+	if (!m_pTexture || getEffect())
+		return size;
+
+	bool fits = size.x <= m_Capacity.x && size.y <= m_Capacity.y;
+	// Only shrink once the node is clearly smaller, to avoid ping-pong.
+	bool wasteful = size.x * 2 < m_Capacity.x || size.y * 2 < m_Capacity.y;
+	if (fits && !wasteful)
+		return m_Capacity;
+
+	IntPoint capacity;
+	capacity.x = (int)(size.x * CAPACITY_GROWTH) + CAPACITY_ALIGN - 1;
+	capacity.y = (int)(size.y * CAPACITY_GROWTH) + CAPACITY_ALIGN - 1;
+	capacity.x -= capacity.x % CAPACITY_ALIGN;
+	capacity.y -= capacity.y % CAPACITY_ALIGN;
+	return capacity;
+}
+
+int CEFNode::calcTileSize(const IntPoint& size) const
+{
+	int maxSize = GLContext::getMain()->getMaxTexSize();
+	if (m_TileSize <= 0)
+		return (size.x > maxSize || size.y > maxSize) ? maxSize : 0;
+	return std::min(m_TileSize, maxSize);
+}
+
+void CEFNode::createTiles(const IntPoint& size, int tileSize)
+{
+	AVG_TRACE(Logger::category::PLUGIN, Logger::severity::DEBUG,
+		"CEFnode: " << tileSize << " tiles for x" << size.x << " y" << size.y);
+	releaseTextures();
+	m_BackingTileSize = tileSize;
+	m_Capacity = size;
+
+	PixelFormat pf = B8G8R8A8;
+	for (int y = 0; y < size.y; y += tileSize)
+	{
+		for (int x = 0; x < size.x; x += tileSize)
+		{
+			IntPoint tile(std::min(tileSize, size.x - x),
+				std::min(tileSize, size.y - y));
+			MCTexturePtr texture = SurfacePool::Get().AcquireTexture(tile, pf);
+			m_Tiles.push_back(texture);
+
+			OGLSurface* surface = new OGLSurface();
+			surface->create(pf, texture);
+			m_TileSurfaces.push_back(surface);
+
+			// The tile's quad in node coordinates.
+			glm::vec2 pos0(x, y);
+			glm::vec2 pos1(x + tile.x, y + tile.y);
+			VertexArrayPtr quad(new VertexArray(4, 6));
+			quad->appendPos(pos0, glm::vec2(0, 0));
+			quad->appendPos(glm::vec2(pos1.x, pos0.y), glm::vec2(1, 0));
+			quad->appendPos(pos1, glm::vec2(1, 1));
+			quad->appendPos(glm::vec2(pos0.x, pos1.y), glm::vec2(0, 1));
+			quad->appendQuadIndexes(1, 0, 2, 3);
+			quad->update();
+			m_TileQuads.push_back(quad);
+		}
+	}
+	// Tiles are drawn through their own surfaces, the node's surface
+	// only has to exist for RasterNode.
+	getSurface()->create(pf, m_Tiles[0]);
+}
+
+bool CEFNode::isOnCanvas() const
+{
+	CanvasPtr canvas = getCanvas();
+	if (!canvas)
+		return false;
+
+	glm::vec2 size = getSize();
+	glm::vec2 corners[] = { getAbsPos(glm::vec2(0, 0)),
+		getAbsPos(glm::vec2(size.x, 0)), getAbsPos(glm::vec2(0, size.y)),
+		getAbsPos(size) };
+	glm::vec2 lo = corners[0];
+	glm::vec2 hi = corners[0];
+	for (int i = 1; i < 4; ++i)
+	{
+		lo = glm::min(lo, corners[i]);
+		hi = glm::max(hi, corners[i]);
+	}
+
+	IntPoint canvasSize = canvas->getSize();
+	return hi.x > 0 && hi.y > 0 && lo.x < canvasSize.x && lo.y < canvasSize.y;
 }
 
 void CEFNode::createSurface()
@@ -66,12 +234,33 @@ void CEFNode::createSurface()
 	m_SurfaceCreated= true;
 	m_LastSize = getSize();
 
-	mWrapper->Resize(glm::uvec2(getWidth(), getHeight()));
-
 	IntPoint size(getWidth(), getHeight());
+	int tileSize = calcTileSize(size);
+	mWrapper->SetTiledUpload(tileSize > 0);
+	if (tileSize > 0)
+	{
+		mWrapper->Resize(glm::uvec2(size), glm::uvec2(size));
+		if (tileSize != m_BackingTileSize || size != m_Capacity)
+			createTiles(size, tileSize);
+		return;
+	}
+	if (m_BackingTileSize > 0)
+		releaseTextures();
+
+	IntPoint capacity = calcCapacity(size);
+
+	mWrapper->Resize(glm::uvec2(size), glm::uvec2(capacity));
+
+	if (m_pTexture && capacity == m_Capacity)
+		return;
+
+	AVG_TRACE(Logger::category::PLUGIN, Logger::severity::DEBUG,
+		"CEFnode: new texture with x" << capacity.x << " y" << capacity.y);
+	m_Capacity = capacity;
 
 	PixelFormat pf = B8G8R8A8;
-	m_pTexture = GLContextManager::get()->createTexture(size, pf, false);
+	SurfacePool::Get().ReleaseTexture(m_pTexture);
+	m_pTexture = SurfacePool::Get().AcquireTexture(capacity, pf);
 	getSurface()->create(pf, m_pTexture);
 }
 
@@ -81,33 +270,42 @@ void CEFNode::preRender(const VertexArrayPtr& pVA, bool bIsParentActive,
         float parentEffectiveOpacity)
 {
 	ScopeTimer timer( prerenderpzid );
-	if (!m_SurfaceCreated || getSize() != m_LastSize)
+	bool effectNeedsFit = getEffect() &&
+		m_Capacity != IntPoint(getWidth(), getHeight());
+	if (!m_SurfaceCreated || getSize() != m_LastSize || effectNeedsFit)
 	{
-		std::cout << "prerender - recreate with x"
-			<< getSize().x << " y" << getSize().y <<  std::endl;
 		if( getSize().x < 1 || getSize().y < 1 )
 		{
 			std::cout << "Tried to prerender with 0 size." << std::endl;
 			return;
 		}
-		setViewport(-32767, -32767, -32767, -32767);
-		m_SurfaceCreated = true;
-		m_LastSize = getSize();
-
-		mWrapper->Resize( glm::uvec2(getWidth(), getHeight()));
-
-		IntPoint size(getWidth(), getHeight());
-		PixelFormat pf = B8G8R8A8;
-		m_pTexture = GLContextManager::get()->createTexture(size, pf, false);
-		getSurface()->create(pf, m_pTexture);
+		createSurface();
 	}
 
 	RasterNode::preRender(pVA, bIsParentActive, parentEffectiveOpacity);
 
+	m_PreRendered = true;
+	m_Shown = isVisible() && isOnCanvas();
+
 	if (isVisible())
 	{
-		mWrapper->ScheduleTexUpload(m_pTexture);
-		scheduleFXRender();
+		// Nothing to upload or re-render unless the browser painted.
+		unsigned generation = mWrapper->GetFrameGeneration();
+		if (generation != m_UploadedGeneration && m_BackingTileSize > 0)
+		{
+			// Tiles are uploaded in render, only where they changed.
+			m_UploadedGeneration = generation;
+		}
+		else if (generation != m_UploadedGeneration)
+		{
+			mWrapper->ScheduleTexUpload(m_pTexture);
+			scheduleFXRender();
+			m_UploadedGeneration = generation;
+		}
+		else
+		{
+			++m_FramesSkipped;
+		}
 	}
 
 	calcVertexArray(pVA);
@@ -118,7 +316,43 @@ static ProfilingZoneID pzid("CEFnode::render");
 void CEFNode::render(GLContext* context, const glm::mat4& transform)
 {
 	ScopeTimer Timer(pzid);
-	blt32(context, transform);
+	if (m_BackingTileSize > 0)
+	{
+		mWrapper->UploadTiles(context, m_Tiles, m_BackingTileSize);
+		renderTiles(context, transform);
+		return;
+	}
+	mWrapper->UploadDirtyRects(context, m_pTexture);
+
+	// The view only covers the top left part of a texture with spare
+	// capacity. Draw it unscaled; the rest of the texture is transparent.
+	IntPoint size(getWidth(), getHeight());
+	if (m_Capacity != size)
+	{
+		glm::vec3 scale(float(m_Capacity.x) / size.x,
+			float(m_Capacity.y) / size.y, 1.0f);
+		blt32(context, glm::scale(transform, scale));
+	}
+	else
+	{
+		blt32(context, transform);
+	}
+}
+
+void CEFNode::renderTiles(GLContext* context, const glm::mat4& transform)
+{
+	// Same state as blt32, with each tile's surface and quad in place of
+	// the node's.
+	context->setBlendMode(getBlendMode(), false);
+	StandardShader* shader = context->getStandardShader();
+	for (size_t i = 0; i < m_Tiles.size(); ++i)
+	{
+		m_TileSurfaces[i]->activate(context, m_Tiles[i]->getSize());
+		shader->setTransform(transform);
+		shader->setAlpha(getEffectiveOpacity());
+		shader->activate();
+		m_TileQuads[i]->draw();
+	}
 }
 
 static ProfilingZoneID updatepzid("CEFnode::update");
@@ -126,11 +360,30 @@ static ProfilingZoneID updatepzid("CEFnode::update");
 void CEFNode::onPreRender()
 {
 	ScopeTimer Timer(updatepzid);
+
+	// Decided on last frame's preRender, which is the latest we know.
+	if (m_AutoHide)
+		mWrapper->SetHidden(!m_PreRendered || !m_Shown);
+	m_PreRendered = false;
+
 	mWrapper->Update();
 }
 
 void CEFNode::renderFX(GLContext* context)
 {
+	// Runs before render, so effects see the current frame.
+	// Not supported with tiles, which render() draws one by one.
+	if (m_BackingTileSize > 0)
+	{
+		if (!m_TileFXWarned)
+		{
+			AVG_TRACE(Logger::category::PLUGIN, Logger::severity::WARNING,
+				"CEFnode: effects aren't supported with tiles, the effect is ignored.");
+			m_TileFXWarned = true;
+		}
+		return;
+	}
+	mWrapper->UploadDirtyRects(context, m_pTexture);
 	RasterNode::renderFX(context);
 }
 
@@ -146,7 +399,10 @@ bool CEFNode::handleEvent(EventPtr ev)
 
 void CEFNode::cleanup()
 {
+	BrowserPool::Get().Clear();
+	SurfacePool::Get().Clear();
 	CefShutdown();
+	CopyPool::Get().Stop();
 }
 
 bool CEFNode::getTransparent() const
@@ -174,6 +430,16 @@ void CEFNode::setMouseInput(bool mouse)
 	m_MouseInput = mouse;
 }
 
+bool CEFNode::getTouchInput() const
+{
+	return m_TouchInput;
+}
+void CEFNode::setTouchInput(bool touch)
+{
+	mWrapper->SetTouchInput( touch );
+	m_TouchInput = touch;
+}
+
 boost::python::object CEFNode::getLoadEndCB() const
 {
 	return mWrapper->GetLoadEndCB();
@@ -219,6 +485,132 @@ void CEFNode::setVolume( double vol )
 	mWrapper->SetVolume( vol );
 }
 
+int CEFNode::getLastUploadBytesSaved() const
+{
+	return mWrapper->GetLastUploadBytesSaved();
+}
+
+long long CEFNode::getUploadBytesSaved() const
+{
+	return mWrapper->GetUploadBytesSaved();
+}
+
+long long CEFNode::getFramesSkipped() const
+{
+	return m_FramesSkipped;
+}
+
+int CEFNode::getFrameRate() const
+{
+	return m_FrameRate;
+}
+void CEFNode::setFrameRate( int rate )
+{
+	mWrapper->SetFrameRate( rate );
+	m_FrameRate = mWrapper->GetFrameRate();
+}
+
+bool CEFNode::getAdaptiveFrameRate() const
+{
+	return m_AdaptiveFrameRate;
+}
+void CEFNode::setAdaptiveFrameRate( bool adaptive )
+{
+	mWrapper->SetAdaptiveFrameRate( adaptive );
+	m_AdaptiveFrameRate = adaptive;
+}
+
+bool CEFNode::getAutoHide() const
+{
+	return m_AutoHide;
+}
+void CEFNode::setAutoHide( bool autohide )
+{
+	m_AutoHide = autohide;
+	if( !autohide )
+		mWrapper->SetHidden( false );
+}
+
+bool CEFNode::getBrowserHidden() const
+{
+	return mWrapper->IsHidden();
+}
+
+long long CEFNode::getLateFrames() const
+{
+	return mWrapper->GetLateFrames();
+}
+
+bool CEFNode::getTileDiff() const
+{
+	return m_TileDiff;
+}
+void CEFNode::setTileDiff( bool enabled )
+{
+	mWrapper->SetTileDiff( enabled );
+	m_TileDiff = enabled;
+}
+
+long long CEFNode::getReportedDirtyBytes() const
+{
+	return mWrapper->GetReportedDirtyBytes();
+}
+
+long long CEFNode::getChangedDirtyBytes() const
+{
+	return mWrapper->GetChangedDirtyBytes();
+}
+
+int CEFNode::getTileSize() const
+{
+	return m_TileSize;
+}
+
+bool CEFNode::getTiled() const
+{
+	return m_BackingTileSize > 0;
+}
+
+boost::python::dict CEFNode::getStats() const
+{
+	const NodeStats& stats = mWrapper->GetStats();
+	long long now = TimeSource::get()->getCurrentMicrosecs();
+
+	boost::python::dict result;
+	result["seconds"] = stats.GetSeconds( now );
+	result["paints"] = stats.GetPaints();
+	result["dirtyPixels"] = stats.GetDirtyPixels();
+	result["copiedBytes"] = stats.GetCopiedBytes();
+	result["uploadedBytes"] = stats.GetUploadedBytes();
+	result["framesSkipped"] = m_FramesSkipped - m_StatsFramesSkipped;
+	result["latencyP50"] = stats.GetLatencyPercentile( 0.5 );
+	result["latencyP95"] = stats.GetLatencyPercentile( 0.95 );
+	result["latencyP99"] = stats.GetLatencyPercentile( 0.99 );
+	result["messages"] = stats.GetMessages();
+	result["messagesPerSecond"] = stats.GetMessageRate( now );
+	result["dispatched"] = stats.GetDispatched();
+	result["dispatchQueueDepth"] = mWrapper->GetDispatchQueueDepth();
+	result["dispatchLatencyP50"] = stats.GetDispatchLatencyPercentile( 0.5 );
+	result["dispatchLatencyP95"] = stats.GetDispatchLatencyPercentile( 0.95 );
+	return result;
+}
+
+boost::python::dict CEFNode::getPoolStats()
+{
+	BrowserPool& pool = BrowserPool::Get();
+	boost::python::dict result;
+	result["hits"] = pool.GetHits();
+	result["misses"] = pool.GetMisses();
+	result["idle"] = pool.GetIdle();
+	return result;
+}
+
+void CEFNode::resetStats()
+{
+	mWrapper->ResetStats();
+	m_StatsFramesSkipped = m_FramesSkipped;
+}
+
 void CEFNode::sendKeyEvent( KeyEventPtr keyevent )
 {
 	mWrapper->ProcessEvent( keyevent, this );
@@ -239,9 +631,19 @@ void CEFNode::executeJS( std::string code )
 	mWrapper->ExecuteJS( code );
 }
 
-void CEFNode::addJSCallback( std::string cmd, boost::python::object cb )
+boost::python::object CEFNode::callJS( boost::python::tuple args,
+	boost::python::dict kwargs )
 {
-	mWrapper->AddJSCallback( cmd, cb );
+	CEFNode& self = extract< CEFNode& >( args[0] );
+	std::string name = extract< std::string >( args[1] );
+	self.mWrapper->CallJS( name, args.slice( 2, _ ) );
+	return object();
+}
+
+void CEFNode::addJSCallback( std::string cmd, boost::python::object cb,
+	int priority )
+{
+	mWrapper->AddJSCallback( cmd, cb, priority );
 }
 void CEFNode::removeJSCallback( std::string cmd )
 {
@@ -258,10 +660,22 @@ void CEFNode::registerType()
 				offsetof(CEFNode, m_Transparent)))
 		.addArg(Arg<bool>("mouseInput", false, false,
 				offsetof(CEFNode, m_MouseInput)))
+		.addArg(Arg<bool>("touchInput", false, false,
+				offsetof(CEFNode, m_TouchInput)))
 		.addArg(Arg<bool>("scrollbars", true, false,
 				offsetof(CEFNode, m_InitScrollbarsEnabled)))
 		.addArg(Arg<double>("volume", 1.0, false,
-				offsetof(CEFNode, m_InitVolume)));
+				offsetof(CEFNode, m_InitVolume)))
+		.addArg(Arg<int>("frameRate", 60, false,
+				offsetof(CEFNode, m_FrameRate)))
+		.addArg(Arg<bool>("adaptiveFrameRate", false, false,
+				offsetof(CEFNode, m_AdaptiveFrameRate)))
+		.addArg(Arg<bool>("autoHide", true, false,
+				offsetof(CEFNode, m_AutoHide)))
+		.addArg(Arg<bool>("tileDiff", false, false,
+				offsetof(CEFNode, m_TileDiff)))
+		.addArg(Arg<int>("tileSize", 0, false,
+				offsetof(CEFNode, m_TileSize)));
 
 	const char* allowedParentNodeNames[] = {"avg", "div", 0};
 	avg::TypeRegistry::get()->registerType(def, allowedParentNodeNames);
@@ -281,10 +695,22 @@ BOOST_PYTHON_MODULE(CEFplugin)
 		.add_property( "transparent", &CEFNode::getTransparent )
 		.add_property( "audioMute", &CEFNode::getAudioMuted )
 		.add_property( "debuggerPort", &CEFNode::getDebuggerPort )
+		.add_property( "lastUploadBytesSaved", &CEFNode::getLastUploadBytesSaved )
+		.add_property( "uploadBytesSaved", &CEFNode::getUploadBytesSaved )
+		.add_property( "framesSkipped", &CEFNode::getFramesSkipped )
+		.add_property( "browserHidden", &CEFNode::getBrowserHidden )
+		.add_property( "lateFrames", &CEFNode::getLateFrames )
+		.add_property( "reportedDirtyBytes", &CEFNode::getReportedDirtyBytes )
+		.add_property( "changedDirtyBytes", &CEFNode::getChangedDirtyBytes )
+		.add_property( "tileSize", &CEFNode::getTileSize )
+		.add_property( "tiled", &CEFNode::getTiled )
+		.add_property( "stats", &CEFNode::getStats )
 
 		// Read-write
 		.add_property( "mouseInput",
 			&CEFNode::getMouseInput, &CEFNode::setMouseInput )
+		.add_property( "touchInput",
+			&CEFNode::getTouchInput, &CEFNode::setTouchInput )
 		.add_property( "onLoadEnd",
 			&CEFNode::getLoadEndCB, &CEFNode::setLoadEndCB )
 		.add_property( "onPluginCrash",
@@ -295,14 +721,26 @@ BOOST_PYTHON_MODULE(CEFplugin)
 			&CEFNode::getScrollbarsEnabled, &CEFNode::setScrollbarsEnabled )
 		.add_property( "volume",
 			&CEFNode::getVolume, &CEFNode::setVolume )
+		.add_property( "frameRate",
+			&CEFNode::getFrameRate, &CEFNode::setFrameRate )
+		.add_property( "adaptiveFrameRate",
+			&CEFNode::getAdaptiveFrameRate, &CEFNode::setAdaptiveFrameRate )
+		.add_property( "autoHide",
+			&CEFNode::getAutoHide, &CEFNode::setAutoHide )
+		.add_property( "tileDiff",
+			&CEFNode::getTileDiff, &CEFNode::setTileDiff )
 
 		// Functions
 		.def( "sendKeyEvent", &CEFNode::sendKeyEvent )
 		.def( "loadURL", &CEFNode::loadURL )
 		.def( "refresh", &CEFNode::refresh )
 		.def( "executeJS", &CEFNode::executeJS )
-		.def( "addJSCallback", &CEFNode::addJSCallback )
-		.def( "removeJSCallback", &CEFNode::removeJSCallback );
+		.def( "callJS", raw_function( &CEFNode::callJS, 2 ) )
+		.def( "addJSCallback", &CEFNode::addJSCallback,
+			( arg( "cmd" ), arg( "cb" ), arg( "priority" ) = 0 ) )
+		.def( "removeJSCallback", &CEFNode::removeJSCallback )
+		.def( "resetStats", &CEFNode::resetStats )
+		.def( "getPoolStats", &CEFNode::getPoolStats ).staticmethod( "getPoolStats" );
 }
 
 AVG_PLUGIN_API PyObject* registerPlugin()
@@ -317,6 +755,18 @@ AVG_PLUGIN_API PyObject* registerPlugin()
 		// Set defaults in case can't load ini.
 		CEFNode::g_AudioMuted = false;
 		CEFNode::g_DebuggerPort = 8088;
+		CEFNode::g_PBOBuffers = 0;
+		CEFNode::g_CopyThreads = 0;
+		CEFNode::g_ResizeInterval = 100;
+		CEFNode::g_PoolTextures = 2;
+		CEFNode::g_PoolBitmaps = 2;
+		CEFNode::g_ExternalBeginFrame = false;
+		CEFNode::g_PumpBudget = 4;
+		CEFNode::g_DispatchBudget = 2;
+		CEFNode::g_MultiThreadedLoop = false;
+		CEFNode::g_PoolBrowsers = 0;
+		CEFNode::g_PoolTransparentBrowsers = 0;
+		CEFNode::g_PoolBrowserSize = glm::uvec2( 1280, 720 );
 
 		INI::Parser conf( "./avg_cefplugin.ini" );
 
@@ -324,8 +774,53 @@ AVG_PLUGIN_API PyObject* registerPlugin()
 
 		CEFNode::g_AudioMuted = conf.top()["mute_audio"] == "true";
 
+		CEFNode::g_ExternalBeginFrame =
+			conf.top()["external_begin_frame"] == "true";
+
+		CEFNode::g_MultiThreadedLoop =
+			conf.top()["multi_threaded_message_loop"] == "true";
+
 		std::string port = conf.top()["debugger_port"];
 		CEFNode::g_DebuggerPort = (uint16_t)atol( port.c_str() );
+
+		std::string pbos = conf.top()["pbo_streaming_buffers"];
+		CEFNode::g_PBOBuffers = std::min( std::max( atoi( pbos.c_str() ), 0 ), 3 );
+
+		std::string threads = conf.top()["copy_threads"];
+		CEFNode::g_CopyThreads = std::max( atoi( threads.c_str() ), 0 );
+
+		std::string interval = conf.top()["resize_interval_ms"];
+		if( !interval.empty() )
+			CEFNode::g_ResizeInterval = std::max( atoi( interval.c_str() ), 0 );
+
+		std::string pooltex = conf.top()["pool_textures"];
+		if( !pooltex.empty() )
+			CEFNode::g_PoolTextures = std::max( atoi( pooltex.c_str() ), 0 );
+
+		std::string poolbmp = conf.top()["pool_bitmaps"];
+		if( !poolbmp.empty() )
+			CEFNode::g_PoolBitmaps = std::max( atoi( poolbmp.c_str() ), 0 );
+
+		std::string budget = conf.top()["pump_budget_ms"];
+		if( !budget.empty() )
+			CEFNode::g_PumpBudget = std::max( atoi( budget.c_str() ), 1 );
+
+		std::string dispatch = conf.top()["dispatch_budget_ms"];
+		if( !dispatch.empty() )
+			CEFNode::g_DispatchBudget = std::max( atoi( dispatch.c_str() ), 0 );
+
+		std::string poolbrowsers = conf.top()["pool_browsers"];
+		CEFNode::g_PoolBrowsers = std::max( atoi( poolbrowsers.c_str() ), 0 );
+
+		std::string pooltransparent = conf.top()["pool_transparent_browsers"];
+		CEFNode::g_PoolTransparentBrowsers =
+			std::max( atoi( pooltransparent.c_str() ), 0 );
+
+		unsigned width, height;
+		std::string poolsize = conf.top()["pool_browser_size"];
+		if( sscanf( poolsize.c_str(), "%ux%u", &width, &height ) == 2 &&
+			width > 0 && height > 0 )
+			CEFNode::g_PoolBrowserSize = glm::uvec2( width, height );
 	}
 	catch( std::runtime_error e )
 	{
@@ -339,16 +834,29 @@ AVG_PLUGIN_API PyObject* registerPlugin()
 	CefMainArgs args(GetModuleHandle(nullptr));
 #endif
 
-	CefRefPtr< CEFApp > app = new CEFApp(
-		CEFNode::g_AudioMuted, CEFNode::g_AdditionalArguments );
+	CefRefPtr< CEFApp > app = new CEFApp( CEFNode::g_AudioMuted,
+		CEFNode::g_ExternalBeginFrame, CEFNode::g_AdditionalArguments );
 
 	if( CEFNode::g_DebuggerPort == 0 ) CEFNode::g_DebuggerPort = 8088;
 
+	CopyPool::Get().Start( CEFNode::g_CopyThreads );
+	SurfacePool::Get().SetLimits( CEFNode::g_PoolTextures, CEFNode::g_PoolBitmaps );
+
+	// CEF tells us when to pump instead of being pumped by every node.
+	// Or it pumps itself on its own UI thread.
+	MessagePump::Get().SetBudget( CEFNode::g_PumpBudget );
+	MessagePump::Get().SetDispatchBudget( CEFNode::g_DispatchBudget );
+	MessagePump::Get().SetPumping( !CEFNode::g_MultiThreadedLoop );
+	app->SetScheduleWorkCB(
+		[]( int64 delay ){ MessagePump::Get().ScheduleWork( delay ); } );
+
 	CefSettings settings;
 	settings.remote_debugging_port = CEFNode::g_DebuggerPort;
 
 	settings.no_sandbox = 1;
 	settings.windowless_rendering_enabled = 1;
+	settings.external_message_pump = !CEFNode::g_MultiThreadedLoop;
+	settings.multi_threaded_message_loop = CEFNode::g_MultiThreadedLoop;
 
 	// Specify the path for the sub-process executable.
 #ifdef _WIN32
@@ -360,6 +868,11 @@ AVG_PLUGIN_API PyObject* registerPlugin()
 	// Initialize CEF in the main process.
 	CefInitialize(args, settings, app.get(), nullptr);
 
+	// Browsers are created over the first frames.
+	BrowserPool::Get().Configure( CEFNode::g_PoolBrowsers,
+		CEFNode::g_PoolTransparentBrowsers, CEFNode::g_PoolBrowserSize, CEFNode::g_ExternalBeginFrame,
+		CEFNode::g_MultiThreadedLoop );
+
 	avg::CEFNode::registerType();
 
 #if PY_MAJOR_VERSION < 3
@@ -21,12 +21,15 @@
 #include <graphics/GLContextManager.h>
 #include <graphics/OGLHelper.h>
 #include <graphics/Color.h>
+#include <graphics/StandardShader.h>
+#include <graphics/VertexArray.h>
 
 #include <wrapper/WrapHelper.h>
 #include <wrapper/raw_constructor.hpp>
 
 
 #include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
 
 #include <string>
 #include <iostream>
@@ -35,7 +38,9 @@
 
 #include <ini.hpp>
 
+#include "browserpool.h"
 #include "cefwrapper.h"
+#include "messagepump.h"
 
 namespace avg
 {
@@ -59,6 +64,12 @@ public:
 	void disconnect(bool kill); // RasterNode : AreaNode : Node
 
 	void createSurface();
+	IntPoint calcCapacity(const IntPoint& size) const;
+	int calcTileSize(const IntPoint& size) const;
+	void createTiles(const IntPoint& size, int tileSize);
+	void releaseTextures();
+	void renderTiles(GLContext* pContext, const glm::mat4& transform);
+	bool isOnCanvas() const;
 
 	void preRender(const VertexArrayPtr& pVA, bool parentActive,
 		float parentEffectiveOpacity); // RasterNode : AreaNode : Node
@@ -67,7 +78,7 @@ public:
 
 	bool handleEvent(EventPtr event); // Node
 
-	// IPreRenderListener
+	// IPreRenderListener, called by MessagePump
 	void onPreRender();
 
 	// Python API
@@ -81,6 +92,8 @@ public:
 
 	void setMouseInput(bool mouse);
 	bool getMouseInput() const;
+	void setTouchInput(bool touch);
+	bool getTouchInput() const;
 
 	boost::python::object getLoadEndCB() const;
 	void setLoadEndCB( boost::python::object );
@@ -95,11 +108,41 @@ public:
 	double getVolume() const;
 	void setVolume( double vol );
 
+	int getLastUploadBytesSaved() const;
+	long long getUploadBytesSaved() const;
+	long long getFramesSkipped() const;
+
+	int getFrameRate() const;
+	void setFrameRate( int rate );
+	bool getAdaptiveFrameRate() const;
+	void setAdaptiveFrameRate( bool adaptive );
+
+	bool getAutoHide() const;
+	void setAutoHide( bool autohide );
+	bool getBrowserHidden() const;
+	long long getLateFrames() const;
+
+	bool getTileDiff() const;
+	void setTileDiff( bool enabled );
+	long long getReportedDirtyBytes() const;
+	long long getChangedDirtyBytes() const;
+
+	int getTileSize() const;
+	bool getTiled() const;
+
+	boost::python::dict getStats() const;
+	void resetStats();
+	// BrowserPool counters, shared by all nodes.
+	static boost::python::dict getPoolStats();
+
 	void sendKeyEvent( KeyEventPtr keyevent );
 	void loadURL( std::string url );
 	void refresh();
 	void executeJS( std::string code );
-	void addJSCallback( std::string cmd, boost::python::object cb );
+	// callJS( name, *args ), needs raw_function for the varargs.
+	static boost::python::object callJS( boost::python::tuple args,
+		boost::python::dict kwargs );
+	void addJSCallback( std::string cmd, boost::python::object cb, int priority );
 	void removeJSCallback( std::string cmd );
 
 
@@ -108,16 +151,71 @@ public:
 	static bool g_AudioMuted;
 	static INI::Level g_AdditionalArguments;
 	static uint16_t g_DebuggerPort;
+	// Number of PBOs used for streaming upload, 0 to disable.
+	static int g_PBOBuffers;
+	// Worker threads for frame copies, 0 copies on the main thread.
+	static int g_CopyThreads;
+	// Minimum time between two relayouts of a resized browser.
+	static int g_ResizeInterval;
+	// Textures and bitmaps kept for reuse by new nodes.
+	static int g_PoolTextures;
+	static int g_PoolBitmaps;
+	// Idle browsers kept for new nodes, how many of them are created
+	// transparent and the size they are created at.
+	static int g_PoolBrowsers;
+	static int g_PoolTransparentBrowsers;
+	static glm::uvec2 g_PoolBrowserSize;
+	// Paint on begin-frames sent once per libavg frame.
+	static bool g_ExternalBeginFrame;
+	// Time per frame the CEF message loop may take.
+	static int g_PumpBudget;
+	// Time per frame queued Python callbacks may take.
+	static int g_DispatchBudget;
+	// CEF runs its message loop on its own thread.
+	static bool g_MultiThreadedLoop;
 
 private:
 
 	glm::vec2 m_LastSize;
 	MCTexturePtr m_pTexture;
+	// Size of m_pTexture, may be larger than the node.
+	IntPoint m_Capacity;
 
 	bool m_SurfaceCreated;
 
+	// Tiled backing, used instead of m_pTexture for nodes that are large
+	// or exceed the maximum texture size. Row-major grid of
+	// m_BackingTileSize textures, smaller at the right and bottom edges.
+	// m_TileSize is the requested size, 0 tiles only when needed.
+	int m_TileSize;
+	int m_BackingTileSize;
+	std::vector<MCTexturePtr> m_Tiles;
+	// Per tile surface and quad, so drawing a tile doesn't touch the
+	// node's own surface.
+	std::vector<OGLSurface*> m_TileSurfaces;
+	std::vector<VertexArrayPtr> m_TileQuads;
+	// Effects aren't drawn with tiles, warned about once.
+	bool m_TileFXWarned;
+
+	// Last CEFWrapper frame generation uploaded to m_pTexture.
+	unsigned m_UploadedGeneration;
+	long long m_FramesSkipped;
+	// m_FramesSkipped at the last resetStats().
+	long long m_StatsFramesSkipped;
+
 	bool m_Transparent;
 	bool m_MouseInput;
+	bool m_TouchInput;
+	int m_FrameRate;
+	bool m_AdaptiveFrameRate;
+	bool m_TileDiff;
+
+	// Hide the browser while the node isn't shown.
+	// preRender isn't called for nodes of canvases that aren't rendered,
+	// so m_PreRendered is cleared every frame and set again there.
+	bool m_AutoHide;
+	bool m_PreRendered;
+	bool m_Shown;
 
 	// Used only to support this setting from constructor.
 	// Doesn't reflect actual value afterwards.
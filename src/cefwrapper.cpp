@@ -6,11 +6,59 @@ namespace avg
 ///****************************************************************
 // CefApp
 
-CEFApp::CEFApp() : mMainInstance( false )
+// Name of the process message carrying a batch of avg.send messages.
+// Its arguments are pairs of command and data.
+static const char* BATCH_MESSAGE = "avg_batch";
+// A batch is sent early when it reaches either limit.
+static const size_t MAX_BATCH_MESSAGES = 256;
+static const size_t MAX_BATCH_BYTES = 64 * 1024;
+// avg.send turns ArrayBuffers and typed arrays into objects with only this
+// key, holding the bytes as string of char codes 0-255. CEF can't read
+// their memory from native code.
+static const char* BINARY_KEY = "__avg_binary__";
+// Process message for callJS. Arguments are the function name and a list
+// of its arguments.
+static const char* CALL_MESSAGE = "avg_call";
+// avg.request and its answer. Arguments are id, command and data, and id,
+// success and result or error message.
+static const char* REQUEST_MESSAGE = "avg_request";
+static const char* RESPONSE_MESSAGE = "avg_response";
+// Default time avg.request waits for an answer.
+static const int REQUEST_TIMEOUT = 10000;
+// Deeper or cyclic data is cut off.
+static const int MAX_VALUE_DEPTH = 32;
+// Volume and scrollbar state of a browser, sent to its renderer whenever
+// it changes. Arguments are volume and whether scrollbars are shown. A
+// renderer that doesn't know it yet asks with PAGE_STATE_REQUEST.
+static const char* PAGE_STATE_MESSAGE = "avg_page_state";
+static const char* PAGE_STATE_REQUEST = "avg_page_state_request";
+
+/*! \brief Runs a function as CEF task. */
+class FuncTask : public CefTask
+{
+public:
+	FuncTask( const std::function< void() >& func ) : mFunc( func ) {}
+	void Execute() OVERRIDE { mFunc(); }
+
+private:
+	std::function< void() > mFunc;
+	IMPLEMENT_REFCOUNTING( FuncTask );
+};
+
+// Request ids start at random, so a renderer that replaced another one
+// after navigating doesn't take its answers for its own.
+static int FirstRequestId()
+{
+	return std::random_device()() & 0x3fffffff;
+}
+
+CEFApp::CEFApp() : mMainInstance( false ), mNextRequest( FirstRequestId() )
 {}
 
-CEFApp::CEFApp( bool a, const INI::Level& args )
-	: mMainInstance( true ), mAudioMuted( a ), mAdditionalArguments( args )
+CEFApp::CEFApp( bool a, bool externalbeginframe, const INI::Level& args )
+	: mMainInstance( true ), mAudioMuted( a ),
+	mExternalBeginFrame( externalbeginframe ), mAdditionalArguments( args ),
+	mNextRequest( FirstRequestId() )
 {}
 
 void CEFApp::OnBeforeCommandLineProcessing(
@@ -22,12 +70,15 @@ void CEFApp::OnBeforeCommandLineProcessing(
 	// We must disable gpu usage to get good frame-rate when offscreen.
 	cmd->AppendSwitch("disable-gpu");
 	cmd->AppendSwitch("disable-gpu-compositing");
-	//cmd->AppendSwitch("enable-begin-frame-scheduling");
 
 	if( mMainInstance )
 	{
 		if( mAudioMuted )
 			cmd->AppendSwitch("mute-audio");
+
+		// Lets CEFWrapper drive paints with SendExternalBeginFrame.
+		if( mExternalBeginFrame )
+			cmd->AppendSwitch("enable-begin-frame-scheduling");
 		
 		const INI::Level& switches = mAdditionalArguments( "switches" );
 		for( auto i = switches.values.begin(); i != switches.values.end(); ++i )
@@ -44,378 +95,1722 @@ void CEFApp::OnBeforeCommandLineProcessing(
 	}
 }
 
+void CEFApp::OnScheduleMessagePumpWork( int64 delay_ms )
+{
+	if( mScheduleWorkCB )
+		mScheduleWorkCB( delay_ms );
+}
+
 void CEFApp::OnWebKitInitialized()
 {
 	// Inject our own communication protocol into JS.
+	// Messages are queued natively and sent as one batch per animation
+	// frame. Hidden pages get no frames, so they are sent after 50ms at
+	// the latest.
 	const char* code =
 		"var avg;"
 		"if (!avg)"
 		"	avg = {};"
 		"(function()"
 		"	{"
+		"		native function send(cmd, data);"
+		"		native function flush();"
+		"		native function coalesce(cmd, enabled);"
+		"		native function expose(name, fn);"
+		"		native function request(cmd, data, resolve, reject, timeout);"
+		"		native function state(apply);"
+		"		var scheduled = false;"
+		"		function binary(buffer)"
+		"			{"
+		"				var bytes = buffer instanceof ArrayBuffer ?"
+		"					new Uint8Array(buffer) :"
+		"					new Uint8Array(buffer.buffer, buffer.byteOffset, buffer.byteLength);"
+		"				var parts = [];"
+		"				for (var i = 0; i < bytes.length; i += 8192)"
+		"					parts.push(String.fromCharCode.apply(null, bytes.subarray(i, i + 8192)));"
+		"				return parts.join('');"
+		"			}"
+		// Only copies objects that contain buffers.
+		"		function pack(value)"
+		"			{"
+		"				if (value === null || typeof value !== 'object')"
+		"					return value;"
+		"				if (value instanceof ArrayBuffer || ArrayBuffer.isView(value))"
+		"					return { __avg_binary__: binary(value) };"
+		"				var copy = null;"
+		"				var keys = Array.isArray(value) ? null : Object.keys(value);"
+		"				var count = keys ? keys.length : value.length;"
+		"				for (var i = 0; i < count; ++i)"
+		"				{"
+		"					var key = keys ? keys[i] : i;"
+		"					var item = value[key];"
+		"					if (item === null || typeof item !== 'object')"
+		"						continue;"
+		"					var packed = pack(item);"
+		"					if (packed === item)"
+		"						continue;"
+		"					if (!copy)"
+		"						copy = keys ? Object.assign({}, value) : value.slice();"
+		"					copy[key] = packed;"
+		"				}"
+		"				return copy || value;"
+		"			}"
+		"		function onFlush()"
+		"			{"
+		"				if (!scheduled)"
+		"					return;"
+		"				scheduled = false;"
+		"				flush();"
+		"			}"
 		"		avg.send = function(cmd, data)"
 		"			{"
-		"				native function send(cmd, data);"
-		"				return send(cmd, data);"
+		"				var result = send(cmd, pack(data));"
+		"				if (!scheduled)"
+		"				{"
+		"					scheduled = true;"
+		"					requestAnimationFrame(onFlush);"
+		"					setTimeout(onFlush, 50);"
+		"				}"
+		"				return result;"
+		"			};"
+		"		avg.flush = function()"
+		"			{"
+		"				scheduled = false;"
+		"				flush();"
+		"			};"
+		"		avg.coalesce = function(cmd, enabled)"
+		"			{"
+		"				coalesce(cmd, enabled !== false);"
 		"			};"
+		"		avg.request = function(cmd, data, timeout)"
+		"			{"
+		"				return new Promise(function(resolve, reject)"
+		"					{"
+		"						request(cmd, pack(data), resolve,"
+		"							function(message) { reject(new Error(message)); },"
+		"							timeout === undefined ? -1 : timeout);"
+		"					});"
+		"			};"
+		"		avg.expose = function(name, fn)"
+		"			{"
+		"				expose(name, fn || null);"
+		"			};"
+		// Volume and scrollbars. Media added later is caught by an observer,
+		// which only runs while there is something to do.
+		"		var volume = 1;"
+		"		var scrollbars = true;"
+		"		var overflowSet = false;"
+		"		var observer = null;"
+		"		function applyScrollbars()"
+		"			{"
+		"				var root = document.documentElement;"
+		"				if (!root)"
+		"					return false;"
+		"				if (!scrollbars)"
+		"				{"
+		"					root.style.overflow = 'hidden';"
+		"					overflowSet = true;"
+		"				}"
+		"				else if (overflowSet)"
+		"				{"
+		"					root.style.overflow = '';"
+		"					overflowSet = false;"
+		"				}"
+		"				return true;"
+		"			}"
+		"		function applyVolume(node)"
+		"			{"
+		"				if (node.tagName === 'AUDIO' || node.tagName === 'VIDEO')"
+		"				{"
+		"					node.volume = volume;"
+		"					return;"
+		"				}"
+		"				var media = node.querySelectorAll('audio, video');"
+		"				for (var i = 0; i < media.length; ++i)"
+		"					media[i].volume = volume;"
+		"			}"
+		"		function watch(enabled)"
+		"			{"
+		"				if (enabled && !observer)"
+		"				{"
+		"					observer = new MutationObserver(onMutations);"
+		"					observer.observe(document, { childList: true, subtree: true });"
+		"				}"
+		"				else if (!enabled && observer)"
+		"				{"
+		"					observer.disconnect();"
+		"					observer = null;"
+		"				}"
+		"			}"
+		"		function onMutations(records)"
+		"			{"
+		"				var rooted = applyScrollbars();"
+		"				if (volume !== 1)"
+		"				{"
+		"					for (var i = 0; i < records.length; ++i)"
+		"					{"
+		"						var added = records[i].addedNodes;"
+		"						for (var j = 0; j < added.length; ++j)"
+		"						{"
+		"							if (added[j].nodeType === 1)"
+		"								applyVolume(added[j]);"
+		"						}"
+		"					}"
+		"				}"
+		"				watch(volume !== 1 || !rooted);"
+		"			}"
+		"		state(function(newVolume, newScrollbars)"
+		"			{"
+		"				volume = newVolume;"
+		"				scrollbars = newScrollbars;"
+		"				var rooted = applyScrollbars();"
+		"				applyVolume(document);"
+		"				watch(volume !== 1 || !rooted);"
+		"			});"
 		"	}"
 		")();";
 	CefRegisterExtension( "v8/avg", code, this );
 }
 
-bool CEFApp::Execute(
-	const CefString& name,
-	CefRefPtr< CefV8Value > object,
-	const CefV8ValueList& arguments,
-	CefRefPtr< CefV8Value >& retval,
-	CefString& exception )
+void CEFApp::OnContextReleased( CefRefPtr< CefBrowser > browser,
+	CefRefPtr< CefFrame > frame, CefRefPtr< CefV8Context > context )
+{
+	Flush( browser );
+	if( frame->IsMain() )
+	{
+		mBatches.erase( browser->GetIdentifier() );
+
+		// The state stays known for the next page.
+		auto state = mPageStates.find( browser->GetIdentifier() );
+		if( state != mPageStates.end() && state->second.mContext &&
+			state->second.mContext->IsSame( context ) )
+		{
+			state->second.mContext = nullptr;
+			state->second.mApply = nullptr;
+		}
+	}
+
+	// Nothing can be settled once the context is gone.
+	for( auto i = mRequests.begin(); i != mRequests.end(); )
+	{
+		if( i->second.mContext->IsSame( context ) )
+			i = mRequests.erase( i );
+		else
+			++i;
+	}
+
+	// Functions can't be called once their context is gone.
+	auto exposed = mExposed.find( browser->GetIdentifier() );
+	if( exposed == mExposed.end() )
+		return;
+	for( auto i = exposed->second.begin(); i != exposed->second.end(); )
+	{
+		if( i->second.mContext->IsSame( context ) )
+			i = exposed->second.erase( i );
+		else
+			++i;
+	}
+	if( exposed->second.empty() )
+		mExposed.erase( exposed );
+}
+
+/*! \brief Owns the memory of ArrayBuffers created from binary values. */
+class ArrayBufferRelease : public CefV8ArrayBufferReleaseCallback
+{
+public:
+	void ReleaseBuffer( void* buffer ) OVERRIDE
+	{
+		delete[] static_cast< unsigned char* >( buffer );
+	}
+
+	IMPLEMENT_REFCOUNTING( ArrayBufferRelease );
+};
+
+/*! \brief Converts a message value to JS. Needs an entered context.
+ * Binary data becomes an ArrayBuffer. */
+static CefRefPtr< CefV8Value > ToV8Value( CefRefPtr< CefValue > value )
+{
+	switch( value->GetType() )
+	{
+	case VTYPE_BOOL:
+		return CefV8Value::CreateBool( value->GetBool() );
+	case VTYPE_INT:
+		return CefV8Value::CreateInt( value->GetInt() );
+	case VTYPE_DOUBLE:
+		return CefV8Value::CreateDouble( value->GetDouble() );
+	case VTYPE_STRING:
+		return CefV8Value::CreateString( value->GetString() );
+	case VTYPE_BINARY:
+	{
+		CefRefPtr< CefBinaryValue > binary = value->GetBinary();
+		size_t size = binary->GetSize();
+		unsigned char* buffer = new unsigned char[size];
+		binary->GetData( buffer, size, 0 );
+		return CefV8Value::CreateArrayBuffer( buffer, size, new ArrayBufferRelease() );
+	}
+	case VTYPE_DICTIONARY:
+	{
+		CefRefPtr< CefDictionaryValue > dict = value->GetDictionary();
+		CefDictionaryValue::KeyList keys;
+		dict->GetKeys( keys );
+		CefRefPtr< CefV8Value > result = CefV8Value::CreateObject( nullptr, nullptr );
+		for( auto i = keys.begin(); i != keys.end(); ++i )
+		{
+			result->SetValue( *i, ToV8Value( dict->GetValue( *i ) ),
+				V8_PROPERTY_ATTRIBUTE_NONE );
+		}
+		return result;
+	}
+	case VTYPE_LIST:
+	{
+		CefRefPtr< CefListValue > list = value->GetList();
+		CefRefPtr< CefV8Value > result = CefV8Value::CreateArray( (int)list->GetSize() );
+		for( size_t i = 0; i < list->GetSize(); ++i )
+			result->SetValue( (int)i, ToV8Value( list->GetValue( i ) ) );
+		return result;
+	}
+	default:
+		return CefV8Value::CreateNull();
+	}
+}
+
+void CEFApp::OnBrowserDestroyed( CefRefPtr< CefBrowser > browser )
+{
+	for( auto i = mRequests.begin(); i != mRequests.end(); )
+	{
+		if( i->second.mBrowser == browser->GetIdentifier() )
+			i = mRequests.erase( i );
+		else
+			++i;
+	}
+	mBatches.erase( browser->GetIdentifier() );
+	mExposed.erase( browser->GetIdentifier() );
+	mPageStates.erase( browser->GetIdentifier() );
+}
+
+bool CEFApp::OnProcessMessageReceived( CefRefPtr< CefBrowser > browser,
+	CefProcessId source_process, CefRefPtr< CefProcessMessage > message )
+{
+	CefRefPtr< CefListValue > args = message->GetArgumentList();
+	if( message->GetName() == CALL_MESSAGE )
+	{
+		CallExposed( browser, args );
+		return true;
+	}
+	else if( message->GetName() == RESPONSE_MESSAGE )
+	{
+		auto request = mRequests.find( args->GetInt( 0 ) );
+		if( request == mRequests.end() || !request->second.mContext->Enter() )
+			return true;
+		CefRefPtr< CefV8Context > context = request->second.mContext;
+		SettleRequest( args->GetInt( 0 ), args->GetBool( 1 ),
+			ToV8Value( args->GetValue( 2 ) ) );
+		context->Exit();
+		return true;
+	}
+	else if( message->GetName() == PAGE_STATE_MESSAGE )
+	{
+		PageState& state = mPageStates[browser->GetIdentifier()];
+		state.mKnown = true;
+		state.mVolume = args->GetDouble( 0 );
+		state.mScrollbars = args->GetBool( 1 );
+		ApplyPageState( state );
+		return true;
+	}
+	return false;
+}
+
+void CEFApp::ApplyPageState( PageState& state )
+{
+	if( !state.mKnown || !state.mApply || !state.mContext->Enter() )
+		return;
+
+	CefRefPtr< CefV8Context > context = state.mContext;
+	CefRefPtr< CefV8Value > apply = state.mApply;
+	CefV8ValueList args;
+	args.push_back( CefV8Value::CreateDouble( state.mVolume ) );
+	args.push_back( CefV8Value::CreateBool( state.mScrollbars ) );
+	apply->ExecuteFunction( nullptr, args );
+	if( apply->HasException() )
+		apply->ClearException();
+	context->Exit();
+}
+
+void CEFApp::SettleRequest( int id, bool ok, CefRefPtr< CefV8Value > value )
+{
+	auto found = mRequests.find( id );
+	if( found == mRequests.end() )
+		return;
+
+	// Removed first, the callbacks may start new requests.
+	Request request = found->second;
+	mRequests.erase( found );
+
+	CefV8ValueList args( 1, value );
+	( ok ? request.mResolve : request.mReject )->ExecuteFunction( nullptr, args );
+}
+
+void CEFApp::CallExposed( CefRefPtr< CefBrowser > browser,
+	CefRefPtr< CefListValue > args )
+{
+	std::string name = args->GetString( 0 );
+	auto exposed = mExposed.find( browser->GetIdentifier() );
+	if( exposed == mExposed.end() ||
+		exposed->second.find( name ) == exposed->second.end() )
+	{
+		std::cerr << "Warning: No function exposed as \"" << name << "\"."
+			<< std::endl;
+		return;
+	}
+
+	Exposed& func = exposed->second[name];
+	if( !func.mContext->Enter() )
+		return;
+
+	CefRefPtr< CefListValue > params = args->GetList( 1 );
+	CefV8ValueList v8args;
+	for( size_t i = 0; i < params->GetSize(); ++i )
+		v8args.push_back( ToV8Value( params->GetValue( i ) ) );
+
+	func.mFunc->ExecuteFunction( nullptr, v8args );
+	if( func.mFunc->HasException() )
+	{
+		std::cerr << "Warning: Exposed function \"" << name << "\" threw: "
+			<< func.mFunc->GetException()->GetMessage().ToString() << std::endl;
+		func.mFunc->ClearException();
+	}
+	func.mContext->Exit();
+}
+
+void CEFApp::Queue( CefRefPtr< CefBrowser > browser, const std::string& cmd,
+	CefRefPtr< CefValue > data, size_t bytes )
+{
+	Batch& batch = mBatches[browser->GetIdentifier()];
+	if( batch.mCoalesced.count( cmd ) )
+	{
+		// Latest value wins, and is delivered in the order it was sent.
+		for( auto i = batch.mMessages.begin(); i != batch.mMessages.end(); ++i )
+		{
+			if( i->mCmd == cmd )
+			{
+				batch.mBytes -= i->mBytes;
+				batch.mMessages.erase( i );
+				break;
+			}
+		}
+	}
+	Message message = { cmd, data, cmd.size() + bytes };
+	batch.mMessages.push_back( message );
+	batch.mBytes += message.mBytes;
+
+	if( batch.mMessages.size() >= MAX_BATCH_MESSAGES ||
+		batch.mBytes >= MAX_BATCH_BYTES )
+		Flush( browser );
+}
+
+void CEFApp::Flush( CefRefPtr< CefBrowser > browser )
+{
+	auto found = mBatches.find( browser->GetIdentifier() );
+	if( found == mBatches.end() || found->second.mMessages.empty() )
+		return;
+
+	Batch& batch = found->second;
+	CefRefPtr< CefProcessMessage > m = CefProcessMessage::Create( BATCH_MESSAGE );
+	CefRefPtr< CefListValue > args = m->GetArgumentList();
+	args->SetSize( batch.mMessages.size() * 2 );
+	for( size_t i = 0; i < batch.mMessages.size(); ++i )
+	{
+		args->SetString( i * 2, batch.mMessages[i].mCmd );
+		args->SetValue( i * 2 + 1, batch.mMessages[i].mData );
+	}
+	batch.mMessages.clear();
+	batch.mBytes = 0;
+
+	browser->SendProcessMessage( PID_BROWSER, m );
+}
+
+/*! \brief Converts a JS value for a process message. Adds an estimate of
+ * its size to bytes. Functions and values CEF can't carry become null. */
+static CefRefPtr< CefValue > ToCefValue( CefRefPtr< CefV8Value > value,
+	size_t& bytes, int depth = 0 )
+{
+	CefRefPtr< CefValue > result = CefValue::Create();
+	bytes += 8;
+	if( depth > MAX_VALUE_DEPTH )
+	{
+		std::cerr << "Warning: avg.send data nested too deeply." << std::endl;
+		result->SetNull();
+	}
+	else if( value->IsBool() )
+	{
+		result->SetBool( value->GetBoolValue() );
+	}
+	else if( value->IsInt() )
+	{
+		result->SetInt( value->GetIntValue() );
+	}
+	else if( value->IsUInt() || value->IsDouble() )
+	{
+		// Also uints beyond int range.
+		result->SetDouble( value->GetDoubleValue() );
+	}
+	else if( value->IsString() )
+	{
+		CefString string = value->GetStringValue();
+		result->SetString( string );
+		bytes += string.length();
+	}
+	else if( value->IsArray() )
+	{
+		CefRefPtr< CefListValue > list = CefListValue::Create();
+		int length = value->GetArrayLength();
+		list->SetSize( length );
+		for( int i = 0; i < length; ++i )
+			list->SetValue( i, ToCefValue( value->GetValue( i ), bytes, depth + 1 ) );
+		result->SetList( list );
+	}
+	else if( value->IsObject() && value->HasValue( BINARY_KEY ) )
+	{
+		std::u16string chars = value->GetValue( BINARY_KEY )->GetStringValue().ToString16();
+		std::vector< unsigned char > data( chars.begin(), chars.end() );
+		result->SetBinary( CefBinaryValue::Create( data.data(), data.size() ) );
+		bytes += data.size();
+	}
+	else if( value->IsObject() && !value->IsFunction() )
+	{
+		CefRefPtr< CefDictionaryValue > dict = CefDictionaryValue::Create();
+		std::vector< CefString > keys;
+		value->GetKeys( keys );
+		for( auto i = keys.begin(); i != keys.end(); ++i )
+		{
+			bytes += i->length();
+			dict->SetValue( *i, ToCefValue( value->GetValue( *i ), bytes, depth + 1 ) );
+		}
+		result->SetDictionary( dict );
+	}
+	else
+	{
+		result->SetNull();
+	}
+	return result;
+}
+
+bool CEFApp::Execute(
+	const CefString& name,
+	CefRefPtr< CefV8Value > object,
+	const CefV8ValueList& arguments,
+	CefRefPtr< CefV8Value >& retval,
+	CefString& exception )
+{
+	CefRefPtr< CefBrowser > browser =
+		CefV8Context::GetCurrentContext()->GetBrowser();
+
+	if( name == "send" )
+	{
+		if( arguments.size() != 2 )
+		{
+			std::cout << "Warning: Incorrect number of arguments: " 
+				<< arguments.size() << " Expected: 2" << std::endl;
+			return false;
+		}
+
+		if( !arguments[0]->IsString() )
+		{
+			std::cerr << "Warning: Argument incorrect type. Expected string command."
+				<< std::endl;
+			return false;
+		}
+
+		size_t bytes = 0;
+		CefRefPtr< CefValue > data = ToCefValue( arguments[1], bytes );
+		Queue( browser, arguments[0]->GetStringValue(), data, bytes );
+		return true;
+	}
+	else if( name == "flush" )
+	{
+		Flush( browser );
+		return true;
+	}
+	else if( name == "coalesce" )
+	{
+		if( arguments.size() != 2 || !arguments[0]->IsString() )
+		{
+			std::cerr << "Warning: avg.coalesce expects a command string."
+				<< std::endl;
+			return false;
+		}
+
+		std::set< std::string >& coalesced =
+			mBatches[browser->GetIdentifier()].mCoalesced;
+		if( arguments[1]->GetBoolValue() )
+			coalesced.insert( arguments[0]->GetStringValue() );
+		else
+			coalesced.erase( arguments[0]->GetStringValue() );
+		return true;
+	}
+
+	else if( name == "request" )
+	{
+		if( arguments.size() != 5 || !arguments[0]->IsString() )
+		{
+			std::cerr << "Warning: avg.request expects a command string."
+				<< std::endl;
+			return false;
+		}
+
+		int id = mNextRequest++;
+		Request request = { browser->GetIdentifier(),
+			CefV8Context::GetCurrentContext(), arguments[2], arguments[3] };
+		mRequests[id] = request;
+
+		// Queued messages go first, so the handler sees what was sent before.
+		Flush( browser );
+		size_t bytes = 0;
+		CefRefPtr< CefProcessMessage > m = CefProcessMessage::Create( REQUEST_MESSAGE );
+		m->GetArgumentList()->SetInt( 0, id );
+		m->GetArgumentList()->SetString( 1, arguments[0]->GetStringValue() );
+		m->GetArgumentList()->SetValue( 2, ToCefValue( arguments[1], bytes ) );
+		browser->SendProcessMessage( PID_BROWSER, m );
+
+		int timeout = arguments[4]->GetIntValue();
+		if( timeout < 0 )
+			timeout = REQUEST_TIMEOUT;
+		if( timeout > 0 )
+		{
+			CefRefPtr< CEFApp > self( this );
+			CefPostDelayedTask( TID_RENDERER, new FuncTask( [=]()
+				{
+					auto found = self->mRequests.find( id );
+					if( found == self->mRequests.end() ||
+						!found->second.mContext->Enter() )
+						return;
+					CefRefPtr< CefV8Context > context = found->second.mContext;
+					self->SettleRequest( id, false,
+						CefV8Value::CreateString( "avg.request timed out" ) );
+					context->Exit();
+				} ), timeout );
+		}
+		return true;
+	}
+	else if( name == "expose" )
+	{
+		if( arguments.size() != 2 || !arguments[0]->IsString() )
+		{
+			std::cerr << "Warning: avg.expose expects a name and a function."
+				<< std::endl;
+			return false;
+		}
+
+		std::map< std::string, Exposed >& exposed =
+			mExposed[browser->GetIdentifier()];
+		if( arguments[1]->IsFunction() )
+		{
+			Exposed func = { CefV8Context::GetCurrentContext(), arguments[1] };
+			exposed[arguments[0]->GetStringValue()] = func;
+		}
+		else
+		{
+			exposed.erase( arguments[0]->GetStringValue() );
+		}
+		return true;
+	}
+
+	else if( name == "state" )
+	{
+		// Only the main frame is controlled.
+		CefRefPtr< CefV8Context > context = CefV8Context::GetCurrentContext();
+		if( arguments.size() != 1 || !arguments[0]->IsFunction() ||
+			!context->GetFrame()->IsMain() )
+			return true;
+
+		int id = browser->GetIdentifier();
+		PageState& state = mPageStates[id];
+		state.mContext = context;
+		state.mApply = arguments[0];
+		if( !state.mKnown )
+		{
+			// First page of this browser in this renderer process.
+			browser->SendProcessMessage( PID_BROWSER,
+				CefProcessMessage::Create( PAGE_STATE_REQUEST ) );
+			return true;
+		}
+
+		// Runs while the context is created, before there is a DOM.
+		CefRefPtr< CEFApp > self( this );
+		CefPostTask( TID_RENDERER, new FuncTask( [=]()
+			{
+				auto found = self->mPageStates.find( id );
+				if( found != self->mPageStates.end() && found->second.mContext &&
+					found->second.mContext->IsSame( context ) )
+					self->ApplyPageState( found->second );
+			} ) );
+		return true;
+	}
+
+	std::cerr << "Warning:Function: \"" << name.ToString() << "\" doesn't exist."
+		<< std::endl;
+	return false;
+}
+
+#ifndef CEF_APP_ONLY
+
+// Dirty area above this fraction of the frame is uploaded in one go.
+static const float FULL_UPLOAD_RATIO = 0.7f;
+
+// CEF doesn't paint faster than this.
+static const int MAX_FRAME_RATE = 60;
+// Adaptive frame rate: after IDLE_DELAY ms without paints or input the
+// rate drops to IDLE_FRAME_RATE. It must stay above 0, otherwise the
+// first paint of a page waking up would never arrive.
+static const int IDLE_FRAME_RATE = 4;
+static const long long IDLE_DELAY = 2000;
+
+// A paint is late when it arrives more than LATE_FRAMES libavg frames after
+// the begin-frame that asked for it. Chromium doesn't paint if nothing
+// changed, so a begin-frame unanswered for BEGIN_FRAME_EXPIRY frames is
+// taken as not needing one.
+static const unsigned LATE_FRAMES = 1;
+static const unsigned BEGIN_FRAME_EXPIRY = 4;
+
+// Tasks from the UI thread that fit before it has to wait for a frame.
+static const size_t MAIN_QUEUE_SIZE = 1024;
+// ms between attempts to move overflowing tasks into the queue.
+static const int OVERFLOW_RETRY_DELAY = 4;
+
+// Page recycled browsers wait on in the pool.
+static const char* BLANK_URL = "about:blank";
+
+// Queue priority of the load end and crash callbacks, the default of
+// message callbacks.
+static const int EVENT_PRIORITY = 0;
+
+static ProfilingZoneID PaintProfilingZone( "CEFWrapper::OnPaint", true );
+static ProfilingZoneID ResizeProfilingZone( "CEFWrapper::Resize" );
+static ProfilingZoneID EventProfilingZone( "CEFWrapper::ProcessEvent" );
+static ProfilingZoneID MessageProfilingZone( "CEFWrapper::CallJSCallback" );
+
+static unsigned long long PackSize( glm::uvec2 size )
+{
+	return ( (unsigned long long)size.x << 32 ) | size.y;
+}
+
+CEFWrapper::CEFWrapper()
+	: mSize( 0, 0 ), mCapacity( 0, 0 ), mViewSize( 0 ), mTransparent( false ),
+	mResizePending( false ), mResizeInterval( 0 ), mLastResizeTime( 0 ),
+	mLastBytesSaved( 0 ), mTotalBytesSaved( 0 ), mTileDiffEnabled( false ),
+	mReportedDirtyBytes( 0 ), mChangedDirtyBytes( 0 ), mFrameGeneration( 0 ),
+	mPaintTime( 0 ),
+	mFrameRate( MAX_FRAME_RATE ), mActiveFrameRate( MAX_FRAME_RATE ),
+	mAdaptiveFrameRate( false ), mLastActivityTime( 0 ), mHidden( false ),
+	mBlankPending( false ),
+	mExternalBeginFrame( false ), mUpdateCount( 0 ), mLastBeginFrameTime( 0 ),
+	mBeginFrameSent( 0 ), mLateFrames( 0 ), mMultiThreaded( false ),
+	mMainTasks( MAIN_QUEUE_SIZE ), mOverflowDrainPosted( false ), mDispatchSeq( 0 ),
+	mPBOCount( 0 ), mStreaming( false ),
+	mTiled( false ), mBrowser( nullptr ), mMovePending( false ),
+	mWheelPending( false ), mPendingWheelDelta( 0, 0 ), m_TouchInput( false ),
+	m_ScrollbarsEnabled( true ), m_Volume( 1.0 )
+{
+	
+}
+
+void CEFWrapper::Init( glm::uvec2 res, bool transparent, int framerate,
+	bool externalbeginframe, bool multithreaded )
+{
+	mMultiThreaded = multithreaded;
+	mTransparent = transparent;
+
+	CefWindowInfo windowinfo;
+	windowinfo.SetAsWindowless( 0, transparent );
+	windowinfo.external_begin_frame_enabled = externalbeginframe;
+	mExternalBeginFrame = externalbeginframe;
+
+	mFrameRate = std::max( 1, std::min( framerate, MAX_FRAME_RATE ) );
+	mActiveFrameRate = mFrameRate;
+	mLastActivityTime = TimeSource::get()->getCurrentMillisecs();
+	ResetStats();
+
+	CefBrowserSettings browsersettings;
+	browsersettings.windowless_frame_rate = mFrameRate;
+
+	if( mMultiThreaded )
+	{
+		// The browser arrives in OnAfterCreated, calls made until then
+		// are queued there.
+		CefRefPtr< CEFWrapper > self( this );
+		CefPostTask( TID_UI, new FuncTask( [=]()
+			{
+				self->mBrowser = new CefRefPtr< CefBrowser >;
+				CefBrowserHost::CreateBrowser(
+					windowinfo, self, "", browsersettings, nullptr );
+			} ) );
+	}
+	else
+	{
+		mBrowser = new CefRefPtr< CefBrowser >;
+		*mBrowser = CefBrowserHost::CreateBrowserSync(
+			windowinfo, this, "",
+			browsersettings, nullptr );
+	}
+
+	Resize( res, res );
+}
+
+void CEFWrapper::Deinit( )
+{
+	delete mBrowser;
+	mBrowser = nullptr;
+}
+
+void CEFWrapper::WithBrowser(
+	const std::function< void( CefRefPtr< CefBrowser > ) >& func )
+{
+	if( !mMultiThreaded )
+	{
+		if( mBrowser && *mBrowser )
+			func( *mBrowser );
+		return;
+	}
+
+	CefRefPtr< CEFWrapper > self( this );
+	CefPostTask( TID_UI, new FuncTask( [=]()
+		{
+			if( !self->mBrowser )
+				return;
+			if( *self->mBrowser )
+				func( *self->mBrowser );
+			else
+				self->mPendingUITasks.push_back( func );
+		} ) );
+}
+
+void CEFWrapper::RunOnMain( const std::function< void() >& func )
+{
+	if( !mMultiThreaded )
+	{
+		func();
+		return;
+	}
+
+	// Keeps the order if the queue was full before.
+	if( mMainOverflow.empty() && mMainTasks.Push( func ) )
+		return;
+	mMainOverflow.push_back( func );
+	if( !mOverflowDrainPosted )
+		PostOverflowDrain();
+}
+
+void CEFWrapper::PostOverflowDrain()
+{
+	// Retries until the main thread made room, so the overflow doesn't
+	// wait for CEF to send another task.
+	mOverflowDrainPosted = true;
+	CefRefPtr< CEFWrapper > self( this );
+	CefPostDelayedTask( TID_UI, new FuncTask( [=]()
+		{
+			self->mOverflowDrainPosted = false;
+			while( !self->mMainOverflow.empty() &&
+				self->mMainTasks.Push( self->mMainOverflow.front() ) )
+				self->mMainOverflow.pop_front();
+			if( !self->mMainOverflow.empty() )
+				self->PostOverflowDrain();
+		} ), OVERFLOW_RETRY_DELAY );
+}
+
+void CEFWrapper::RunMainTasks()
+{
+	std::function< void() > task;
+	while( mMainTasks.Pop( task ) )
+		task();
+}
+
+void CEFWrapper::Dispatch( int priority, const std::function< void() >& func )
+{
+	DispatchTask task;
+	task.mPriority = priority;
+	task.mSeq = mDispatchSeq++;
+	task.mTime = TimeSource::get()->getCurrentMicrosecs();
+	task.mFunc = func;
+	mDispatchQueue.push( task );
+}
+
+void CEFWrapper::RunDispatchQueue()
+{
+	// At least one per frame, so no node starves behind the others.
+	bool first = true;
+	while( !mDispatchQueue.empty() &&
+		( first || MessagePump::Get().InDispatchBudget() ) )
+	{
+		first = false;
+		DispatchTask task = mDispatchQueue.top();
+		mDispatchQueue.pop();
+		mStats.AddDispatch( TimeSource::get()->getCurrentMicrosecs() - task.mTime );
+		task.mFunc();
+	}
+}
+
+void CEFWrapper::Close()
+{
+	WithBrowser( []( CefRefPtr< CefBrowser > browser )
+		{
+			browser->GetHost()->CloseBrowser( false );
+		} );
+
+	// Paints arriving until the browser is gone are dropped.
+	ReleaseSurfaces();
+}
+
+void CEFWrapper::ReleaseSurfaces()
+{
+	SurfacePool::Get().ReleaseBitmap( mRenderBitmap );
+	mRenderBitmap.reset();
+	mStreaming = false;
+	mPBORing.Deinit();
+}
+
+void CEFWrapper::SetTileDiff( bool enabled )
+{
+	mTileDiffEnabled = enabled;
+	mTileDiff.Reset();
+}
+
+void CEFWrapper::ClearCallbacks()
+{
+	// In multi-threaded mode the last reference to us may be dropped on
+	// the UI thread, which must not release Python objects.
+	mJSCBs.clear();
+	mDispatchQueue = std::priority_queue< DispatchTask >();
+	mLoadEndCB = boost::python::object();
+	mPluginCrashCB = boost::python::object();
+	mRendererCrashCB = boost::python::object();
+}
+
+void CEFWrapper::TakeCallbacks( CEFWrapper& other )
+{
+	mJSCBs.swap( other.mJSCBs );
+	mLoadEndCB = other.mLoadEndCB;
+	mPluginCrashCB = other.mPluginCrashCB;
+	mRendererCrashCB = other.mRendererCrashCB;
+	other.ClearCallbacks();
+}
+
+void CEFWrapper::Recycle()
+{
+	ClearCallbacks();
+	SetMouseInput( false );
+	SetTouchInput( false );
+	mMovePending = false;
+	mWheelPending = false;
+	mPendingWheelDelta = glm::vec2( 0, 0 );
+	SetHidden( true );
+
+	// Paints arriving while idle are dropped.
+	ReleaseSurfaces();
+
+	mBlankPending = true;
+	LoadURL( BLANK_URL );
+}
+
+void CEFWrapper::LoadURL( std::string url )
+{
+	NoteActivity();
+	WithBrowser( [=]( CefRefPtr< CefBrowser > browser )
+		{
+			browser->GetMainFrame()->LoadURL( url );
+		} );
+}
+
+void CEFWrapper::Refresh()
+{
+	NoteActivity();
+	WithBrowser( []( CefRefPtr< CefBrowser > browser )
+		{
+			browser->Reload();
+		} );
+}
+
+void CEFWrapper::Update()
+{
+	if( mMultiThreaded )
+	{
+		RunMainTasks();
+		const FrameSlot::Frame* frame = mFrameSlot.Read();
+		if( frame )
+			ApplyPaint( frame->mPixels.data(), frame->mWidth, frame->mHeight,
+				frame->mDirty, frame->mTime );
+	}
+	RunDispatchQueue();
+	FlushInput();
+
+	FlushResize();
+
+	if( mAdaptiveFrameRate && mActiveFrameRate > IDLE_FRAME_RATE )
+	{
+		long long now = TimeSource::get()->getCurrentMillisecs();
+		if( now - mLastActivityTime >= IDLE_DELAY )
+			ApplyFrameRate( std::min( IDLE_FRAME_RATE, mFrameRate ) );
+	}
+
+	++mUpdateCount;
+	if( mExternalBeginFrame )
+		SendBeginFrame();
+}
+
+void CEFWrapper::SendBeginFrame()
+{
+	if( mHidden )
+		return;
+
+	// Honour frameRate and the adaptive idle rate. Allow some jitter so
+	// a rate equal to the display rate doesn't drop frames.
+	long long now = TimeSource::get()->getCurrentMillisecs();
+	if( now - mLastBeginFrameTime < 750 / mActiveFrameRate )
+		return;
+	mLastBeginFrameTime = now;
+
+	if( mBeginFrameSent && mUpdateCount - mBeginFrameSent > BEGIN_FRAME_EXPIRY )
+		mBeginFrameSent = 0;
+	if( !mBeginFrameSent )
+		mBeginFrameSent = mUpdateCount;
+
+	WithBrowser( []( CefRefPtr< CefBrowser > browser )
+		{
+			browser->GetHost()->SendExternalBeginFrame();
+		} );
+}
+
+void CEFWrapper::SetFrameRate( int rate )
+{
+	mFrameRate = std::max( 1, std::min( rate, MAX_FRAME_RATE ) );
+	mLastActivityTime = TimeSource::get()->getCurrentMillisecs();
+	ApplyFrameRate( mFrameRate );
+}
+
+void CEFWrapper::SetAdaptiveFrameRate( bool adaptive )
+{
+	mAdaptiveFrameRate = adaptive;
+	NoteActivity();
+}
+
+void CEFWrapper::SetHidden( bool hidden )
+{
+	if( hidden == mHidden )
+		return;
+
+	mHidden = hidden;
+	WithBrowser( [=]( CefRefPtr< CefBrowser > browser )
+		{
+			browser->GetHost()->WasHidden( hidden );
+		} );
+	if( !hidden )
+		NoteActivity();
+}
+
+void CEFWrapper::NoteActivity()
+{
+	mLastActivityTime = TimeSource::get()->getCurrentMillisecs();
+	if( mActiveFrameRate != mFrameRate )
+		ApplyFrameRate( mFrameRate );
+}
+
+void CEFWrapper::ApplyFrameRate( int rate )
+{
+	mActiveFrameRate = rate;
+	WithBrowser( [=]( CefRefPtr< CefBrowser > browser )
+		{
+			browser->GetHost()->SetWindowlessFrameRate( rate );
+		} );
+}
+
+void CEFWrapper::ScheduleTexUpload( avg::MCTexturePtr texture )
+{
+	if( mDirtyRegion.IsEmpty() )
+		return;
+
+	mDirtyRegion.Optimize();
+	if( mDirtyRegion.GetArea() < mDirtyRegion.GetFullArea() * FULL_UPLOAD_RATIO )
+		return; // Left for UploadDirtyRects.
+
+	avg::GLContextManager::get()->scheduleTexUpload(texture, mRenderBitmap);
+	NoteUpload( (long long)mRenderBitmap->getStride() * mCapacity.y );
+
+	mLastBytesSaved = 0;
+	mDirtyRegion.Clear();
+}
+
+void CEFWrapper::UploadDirtyRects( avg::GLContext* context,
+	avg::MCTexturePtr texture )
+{
+	if( mStreaming )
+	{
+		int bytes = mPBORing.Upload( context, texture );
+		if( bytes > 0 )
+		{
+			NoteUpload( bytes );
+			mLastBytesSaved = mCapacity.x * mCapacity.y * 4 - bytes;
+			mTotalBytesSaved += mLastBytesSaved;
+		}
+		return;
+	}
+
+	UploadBitmapRects( context, texture );
+
+	// Texture is up to date now, so paints can go to a fresh ring.
+	if( mPBOCount > 0 && !mTiled )
+	{
+		if( mPBORing.Init( mCapacity, mPBOCount ) )
+		{
+			mStreaming = true;
+		}
+		else
+		{
+			std::cerr << "Warning: Streaming upload not available, "
+				"using bitmap upload." << std::endl;
+			mPBOCount = 0;
+		}
+	}
+}
+
+void CEFWrapper::UploadBitmapRects( avg::GLContext* context,
+	avg::MCTexturePtr texture )
+{
+	if( mDirtyRegion.IsEmpty() )
+		return;
+
+	mDirtyRegion.Optimize();
+	UploadRects( context, texture, mDirtyRegion.GetRects(), 0, 0 );
+
+	const int bpp = mRenderBitmap->getBytesPerPixel();
+	NoteUpload( (long long)mDirtyRegion.GetArea() * bpp );
+	mLastBytesSaved = ( mDirtyRegion.GetFullArea() - mDirtyRegion.GetArea() ) * bpp;
+	mTotalBytesSaved += mLastBytesSaved;
+	mDirtyRegion.Clear();
+}
+
+void CEFWrapper::SetTiledUpload( bool tiled )
+{
+	if( tiled && mStreaming )
+	{
+		// The bitmap is stale while streaming, so start over from a repaint.
+		mStreaming = false;
+		mDirtyRegion.AddAll();
+		WithBrowser( []( CefRefPtr< CefBrowser > browser )
+			{
+				browser->GetHost()->Invalidate( PET_VIEW );
+			} );
+	}
+	mTiled = tiled;
+}
+
+void CEFWrapper::UploadTiles( avg::GLContext* context,
+	const std::vector< avg::MCTexturePtr >& tiles, int tilesize )
+{
+	if( mDirtyRegion.IsEmpty() || tiles.empty() || tilesize <= 0 )
+		return;
+
+	mDirtyRegion.Optimize();
+
+	// Tiles the region doesn't touch aren't bound, let alone uploaded.
+	const int columns = ( mCapacity.x + tilesize - 1 ) / tilesize;
+	DirtyRegion part;
+	part.SetBounds( mCapacity.x, mCapacity.y );
+	for( size_t i = 0; i < tiles.size(); ++i )
+	{
+		CefRect tile( int( i % columns ) * tilesize, int( i / columns ) * tilesize,
+			tilesize, tilesize );
+		part.Clear();
+		part.Add( mDirtyRegion, tile );
+		if( !part.IsEmpty() )
+			UploadRects( context, tiles[i], part.GetRects(), tile.x, tile.y );
+	}
+
+	const int bpp = mRenderBitmap->getBytesPerPixel();
+	NoteUpload( (long long)mDirtyRegion.GetArea() * bpp );
+	mLastBytesSaved = ( mDirtyRegion.GetFullArea() - mDirtyRegion.GetArea() ) * bpp;
+	mTotalBytesSaved += mLastBytesSaved;
+	mDirtyRegion.Clear();
+}
+
+void CEFWrapper::NoteUpload( long long bytes )
+{
+	mStats.AddUpload( bytes );
+	if( mPaintTime )
+	{
+		mStats.AddLatency( TimeSource::get()->getCurrentMicrosecs() - mPaintTime );
+		mPaintTime = 0;
+	}
+}
+
+void CEFWrapper::ResetStats()
+{
+	mStats.Reset( TimeSource::get()->getCurrentMicrosecs() );
+}
+
+void CEFWrapper::UploadRects( avg::GLContext* context, avg::MCTexturePtr texture,
+	const std::vector< CefRect >& rects, int originx, int originy )
+{
+	const int bpp = mRenderBitmap->getBytesPerPixel();
+	const int stride = mRenderBitmap->getStride();
+	const unsigned char* pixels = mRenderBitmap->getPixels();
+	GLenum format = TexInfo::getGLFormat( mRenderBitmap->getPixelFormat() );
+	GLenum type = TexInfo::getGLType( mRenderBitmap->getPixelFormat() );
+
+	context->bindTexture( GL_TEXTURE0, texture->getID( context ) );
+
+	if( !context->isGLES() )
+	{
+		glPixelStorei( GL_UNPACK_ROW_LENGTH, stride / bpp );
+		for( auto i = rects.begin(); i != rects.end(); ++i )
+		{
+			glTexSubImage2D( GL_TEXTURE_2D, 0, i->x - originx, i->y - originy,
+				i->width, i->height, format, type,
+				pixels + i->y * stride + i->x * bpp );
+		}
+		glPixelStorei( GL_UNPACK_ROW_LENGTH, 0 );
+	}
+	else
+	{
+		// No GL_UNPACK_ROW_LENGTH, so pack each rect first.
+		for( auto i = rects.begin(); i != rects.end(); ++i )
+		{
+			int rowbytes = i->width * bpp;
+			mPackBuffer.resize( rowbytes * i->height );
+			CopyPool::CopyRect( pixels, stride, mPackBuffer.data(), rowbytes,
+				CefRect( i->x, i->y, i->width, i->height ), bpp );
+			glTexSubImage2D( GL_TEXTURE_2D, 0, i->x - originx, i->y - originy,
+				i->width, i->height, format, type, mPackBuffer.data() );
+		}
+	}
+	GLContext::checkError( "CEFWrapper::UploadRects" );
+}
+
+static void ClearRects( unsigned char* pixels, int stride,
+	const std::vector< CefRect >& rects )
+{
+	for( auto i = rects.begin(); i != rects.end(); ++i )
+	{
+		unsigned char* row = pixels + i->y * stride + i->x * 4;
+		for( int y = 0; y < i->height; ++y, row += stride )
+			memset( row, 0, i->width * 4 );
+	}
+}
+
+void CEFWrapper::Resize( glm::uvec2 size, glm::uvec2 capacity )
+{
+	ScopeTimer timer( ResizeProfilingZone );
+	if( size.x == 0 || size.y == 0 )
+	{
+		std::cerr << "Warning: Tried resize texture to 0" << std::endl;
+	}
+	glm::uvec2 oldsize = mSize;
+	mSize = size;
+	mViewSize = PackSize( size );
+
+	// Hashes may not match the new bitmap contents.
+	mTileDiff.Reset();
+
+	if( !mRenderBitmap || capacity != mCapacity )
+	{
+		// Only way to resize bitmap is to recreate it.
+		// Storage comes from and goes back to the pool.
+		avg::BitmapPtr oldbitmap = mRenderBitmap;
+		mRenderBitmap = SurfacePool::Get().AcquireBitmap(
+			IntPoint( capacity.x, capacity.y ), avg::B8G8R8A8 );
+		memset( mRenderBitmap->getPixels(), 0,
+			mRenderBitmap->getStride() * capacity.y );
+
+		// Keep the old content until the browser repaints.
+		// While streaming the old bitmap is stale, so ask for a repaint.
+		if( oldbitmap && !mStreaming )
+		{
+			CefRect keep( 0, 0, std::min( oldsize.x, size.x ),
+				std::min( oldsize.y, size.y ) );
+			CopyPool::CopyRect( oldbitmap->getPixels(), oldbitmap->getStride(),
+				mRenderBitmap->getPixels(), mRenderBitmap->getStride(), keep, 4 );
+		}
+		else if( oldbitmap )
+		{
+			WithBrowser( []( CefRefPtr< CefBrowser > browser )
+				{
+					browser->GetHost()->Invalidate( PET_VIEW );
+				} );
+		}
+		SurfacePool::Get().ReleaseBitmap( oldbitmap );
+
+		mCapacity = capacity;
+		mDirtyRegion.SetBounds( capacity.x, capacity.y );
+		mDirtyRegion.AddAll();
+
+		// Ring is recreated at the new size once the bitmap was uploaded.
+		mStreaming = false;
+	}
+	else if( size != oldsize )
+	{
+		// Texture keeps its size. What the view doesn't cover anymore must
+		// be transparent, as the node draws the texture unscaled.
+		DirtyRegion uncovered;
+		uncovered.SetBounds( capacity.x, capacity.y );
+		if( oldsize.x > size.x )
+			uncovered.Add( CefRect( size.x, 0, oldsize.x - size.x, oldsize.y ) );
+		if( oldsize.y > size.y )
+			uncovered.Add( CefRect( 0, size.y, std::min( oldsize.x, size.x ),
+				oldsize.y - size.y ) );
+
+		unsigned char* dst = mStreaming ?
+			mPBORing.BeginWrite( capacity.x, capacity.y ) : nullptr;
+		if( dst )
+		{
+			ClearRects( dst, mPBORing.GetStride(), uncovered.GetRects() );
+			mPBORing.EndWrite( uncovered );
+		}
+		else if( mStreaming )
+		{
+			// Ring is full and the bitmap stale. Start over with a repaint.
+			mStreaming = false;
+			memset( mRenderBitmap->getPixels(), 0,
+				mRenderBitmap->getStride() * capacity.y );
+			mDirtyRegion.AddAll();
+			WithBrowser( []( CefRefPtr< CefBrowser > browser )
+				{
+					browser->GetHost()->Invalidate( PET_VIEW );
+				} );
+		}
+		else
+		{
+			ClearRects( mRenderBitmap->getPixels(), mRenderBitmap->getStride(),
+				uncovered.GetRects() );
+			mDirtyRegion.Add( uncovered );
+		}
+	}
+	++mFrameGeneration;
+
+	if( size != oldsize )
+	{
+		mResizePending = true;
+		FlushResize();
+	}
+}
+
+void CEFWrapper::FlushResize()
+{
+	if( !mResizePending )
+		return;
+
+	// Throttle relayouts while a node's size is animated.
+	long long now = TimeSource::get()->getCurrentMillisecs();
+	if( now - mLastResizeTime < mResizeInterval )
+		return;
+
+	mLastResizeTime = now;
+	mResizePending = false;
+	WithBrowser( []( CefRefPtr< CefBrowser > browser )
+		{
+			browser->GetHost()->WasResized();
+		} );
+}
+
+bool CEFWrapper::GetViewRect(
+	CefRefPtr<CefBrowser> browser, CefRect &rect )
+{
+	unsigned long long size = mViewSize;
+	rect = CefRect( 0, 0, (int)( size >> 32 ), (int)( size & 0xffffffff ) );
+	return true;
+}
+
+void CEFWrapper::OnPaint( CefRefPtr<CefBrowser> browser,
+							PaintElementType type,
+							const RectList &dirtyRects,
+							const void* buffer,
+							int width,
+							int height )
+{
+	// Popups like <select> dropdowns aren't drawn. Their buffers would
+	// land in the view's top-left corner.
+	if( type != PET_VIEW )
+		return;
+
+	ScopeTimer timer( PaintProfilingZone );
+	long long now = TimeSource::get()->getCurrentMicrosecs();
+
+	DirtyRegion painted;
+	painted.SetBounds( width, height );
+	for( auto i = dirtyRects.begin(); i != dirtyRects.end(); ++i )
+		painted.Add( *i );
+	painted.Optimize();
+
+	// The buffer is only valid during this call.
+	const unsigned char* src = static_cast< const unsigned char* >(buffer);
+	if( mMultiThreaded )
+		mFrameSlot.Write( src, width, height, painted, now );
+	else
+		ApplyPaint( src, width, height, painted, now );
+}
+
+void CEFWrapper::ApplyPaint( const unsigned char* src, int width, int height,
+	const DirtyRegion& dirty, long long painttime )
 {
-	if( name == "send" )
-	{
-		if( arguments.size() != 2 )
-		{
-			std::cout << "Warning: Incorrect number of arguments: " 
-				<< arguments.size() << " Expected: 2" << std::endl;
-			return false;
-		}
-
-		if( !arguments[0]->IsString() || !arguments[1]->IsString() )
-		{
-			std::cerr << "Warning: Argument incorrect type. Expected strings." 
-				<< std::endl;
-			return false;
-		}
+	if( !mRenderBitmap )
+		return;
 
+	NoteActivity();
 
-		std::string cmd = arguments[0]->GetStringValue();
-		CefRefPtr< CefProcessMessage > m = CefProcessMessage::Create( cmd );
+	if( mBeginFrameSent )
+	{
+		if( mUpdateCount - mBeginFrameSent > LATE_FRAMES )
+			++mLateFrames;
+		mBeginFrameSent = 0;
+	}
 
-		m->GetArgumentList()->SetString( 0, arguments[1]->GetStringValue() );
+	if( width > mRenderBitmap->getSize().x ||
+		height > mRenderBitmap->getSize().y )
+	{
+		std::cerr << "Warning: texture size mismatch" << std::endl;
+		return;
+	}
 
-		CefV8Context::GetCurrentContext()->GetBrowser()->SendProcessMessage(
-			PID_BROWSER, m );
+	// Only copy what CEF reports as changed. Paints at an outdated size
+	// are clipped, so the space outside the view stays transparent.
+	DirtyRegion painted;
+	painted.SetBounds( std::min( width, (int)mSize.x ),
+		std::min( height, (int)mSize.y ) );
+	painted.Add( dirty );
+	painted.Optimize();
+
+	const int reported = painted.GetArea();
+	mReportedDirtyBytes += reported * 4;
+	if( mTileDiffEnabled )
+	{
+		DirtyRegion changed;
+		mTileDiff.Refine( src, width * 4, width, height, painted, changed );
+		painted.Clear();
+		painted.Add( changed );
+	}
+	mChangedDirtyBytes += painted.GetArea() * 4;
+	if( painted.IsEmpty() )
+	{
+		mStats.AddPaint( reported, 0 );
+		return;
+	}
+	mPaintTime = painttime;
+
+	// src may only be valid during this call, so the copy jobs
+	// have to be finished before returning.
+	PixelKernels::RowFunc convert =
+		mTransparent ? PixelKernels::Unpremultiply : nullptr;
+	CopyPool::Fence fence;
+	if( mStreaming )
+	{
+		unsigned char* dst = mPBORing.BeginWrite( width, height );
+		if( dst )
+		{
+			CopyPool::Get().CopyRegion( src, width * 4, dst,
+				mPBORing.GetStride(), painted, fence, convert );
+			CopyPool::Get().Wait( fence );
+			mPBORing.EndWrite( painted );
+			mStats.AddPaint( reported, painted.GetArea() * 4 );
+			++mFrameGeneration;
+			return;
+		}
 
-		return true;
+		// Ring is full. The bitmap is stale while streaming, so refresh all
+		// of it and restart the ring after the next upload.
+		mStreaming = false;
+		memset( mRenderBitmap->getPixels(), 0,
+			mRenderBitmap->getStride() * mCapacity.y );
+		mDirtyRegion.AddAll();
+		painted.AddAll();
 	}
 
-	std::cerr << "Warning:Function: \"" << name.ToString() << "\" doesn't exist."
-		<< std::endl;
-	return false;
+	CopyPool::Get().CopyRegion( src, width * 4, mRenderBitmap->getPixels(),
+		mRenderBitmap->getStride(), painted, fence, convert );
+	CopyPool::Get().Wait( fence );
+	mStats.AddPaint( reported, painted.GetArea() * 4 );
+
+	mDirtyRegion.Add( painted );
+	++mFrameGeneration;
 }
 
-#ifndef CEF_APP_ONLY
 
-CEFWrapper::CEFWrapper()
+void CEFWrapper::ProcessEvent( EventPtr ev, Node* cefnode )
 {
-	
+	ScopeTimer timer( EventProfilingZone );
+	NoteActivity();
+
+	// The type says which class it is, no need to try casts.
+	switch( ev->getType() )
+	{
+	case Event::CURSOR_MOTION:
+	case Event::CURSOR_UP:
+	case Event::CURSOR_DOWN:
+		if( m_MouseInput && ev->getSource() == Event::MOUSE )
+			ProcessMouseEvent( static_cast< MouseEvent& >( *ev ), cefnode );
+		else if( m_TouchInput && ev->getSource() == Event::TOUCH )
+			ProcessTouchEvent( static_cast< CursorEvent& >( *ev ), cefnode );
+		break;
+
+	case Event::CURSOR_OUT:
+		if( m_TouchInput && ev->getSource() == Event::TOUCH )
+			ProcessTouchEvent( static_cast< CursorEvent& >( *ev ), cefnode );
+		break;
+
+	case Event::MOUSE_WHEEL:
+		if( m_MouseInput )
+			ProcessWheelEvent( static_cast< MouseWheelEvent& >( *ev ), cefnode );
+		break;
+
+	case Event::KEY_UP:
+	case Event::KEY_DOWN:
+		ProcessKeyEvent( static_cast< KeyEvent& >( *ev ) );
+		break;
+
+	default:
+		break;
+	}
 }
 
-void CEFWrapper::Init( glm::uvec2 res, bool transparent )
+void CEFWrapper::ProcessMouseEvent( const MouseEvent& mouse, Node* cefnode )
 {
-	mBrowser = new CefRefPtr< CefBrowser >;
+	glm::vec2 coords = cefnode->getRelPos( mouse.getPos() );
 
-	CefWindowInfo windowinfo;
-	windowinfo.SetAsWindowless( 0, transparent );
+	CefMouseEvent cefevent;
+	cefevent.x = (int)coords.x;
+	cefevent.y = (int)coords.y;
 
-	CefBrowserSettings browsersettings;
-	browsersettings.windowless_frame_rate = 60;
+	CefBrowserHost::MouseButtonType btntype;
+	switch( mouse.getButton() )
+	{
+	case MouseEvent::LEFT_BUTTON:
+		btntype = MBT_LEFT;
+		cefevent.modifiers |= EVENTFLAG_LEFT_MOUSE_BUTTON;
+		break;
+	case MouseEvent::MIDDLE_BUTTON:
+		btntype = MBT_MIDDLE;
+		cefevent.modifiers |= EVENTFLAG_MIDDLE_MOUSE_BUTTON;
+		break;
+	case MouseEvent::RIGHT_BUTTON:
+		btntype = MBT_RIGHT;
+		cefevent.modifiers |= EVENTFLAG_RIGHT_MOUSE_BUTTON;
+		break;
+	}
 
-	*mBrowser = CefBrowserHost::CreateBrowserSync(
-		windowinfo, this, "",
-		browsersettings, nullptr );
+	// Only the last move of a frame is sent.
+	if( mouse.getType() == Event::CURSOR_MOTION )
+	{
+		mPendingMove = cefevent;
+		mMovePending = true;
+		return;
+	}
 
-	Resize( res );
+	// The browser sees the pointer where it was clicked.
+	FlushInput();
+	bool mouseUp = mouse.getType() == Event::CURSOR_UP;
+	WithBrowser( [=]( CefRefPtr< CefBrowser > browser )
+		{
+			browser->GetHost()->SendMouseClickEvent( cefevent, btntype, mouseUp, 1 );
+		} );
 }
 
-void CEFWrapper::Deinit( )
+void CEFWrapper::ProcessWheelEvent( const MouseWheelEvent& wheel, Node* cefnode )
 {
-	delete mBrowser;
+	// Turns of a frame add up and are sent at the last position.
+	glm::vec2 pos = cefnode->getRelPos( wheel.getPos() );
+	mPendingWheel.x = (int)pos.x;
+	mPendingWheel.y = (int)pos.y;
+	mPendingWheelDelta += wheel.getMotion() * 40.0f;
+	mWheelPending = true;
 }
 
-void CEFWrapper::Close()
+void CEFWrapper::ProcessTouchEvent( const CursorEvent& touch, Node* cefnode )
 {
-	(*mBrowser)->GetHost()->CloseBrowser( false ); 
-}
+	int id = touch.getCursorID();
+	glm::vec2 coords = cefnode->getRelPos( touch.getPos() );
 
-void CEFWrapper::LoadURL( std::string url )
-{
-	(*mBrowser)->GetMainFrame()->LoadURL(url);
-}
+	CefTouchEvent cefevent;
+	cefevent.id = id;
+	cefevent.x = coords.x;
+	cefevent.y = coords.y;
+	cefevent.pointer_type = CEF_POINTER_TYPE_TOUCH;
 
-void CEFWrapper::Refresh()
-{
-	(*mBrowser)->Reload();
-}
+	switch( touch.getType() )
+	{
+	case Event::CURSOR_DOWN:
+		cefevent.type = CEF_TET_PRESSED;
+		mTouches[id] = cefevent;
+		break;
+
+	case Event::CURSOR_MOTION:
+		// Only the newest move of each contact per frame is sent.
+		if( mTouches.count( id ) )
+		{
+			cefevent.type = CEF_TET_MOVED;
+			mTouches[id] = cefevent;
+			mPendingTouchMoves[id] = cefevent;
+		}
+		return;
 
-void CEFWrapper::Update()
-{
-	CefDoMessageLoopWork();
+	case Event::CURSOR_UP:
+		if( !mTouches.erase( id ) )
+			return;
+		cefevent.type = CEF_TET_RELEASED;
+		break;
+
+	case Event::CURSOR_OUT:
+		// Once it left the node, the node won't see it released.
+		if( !mTouches.erase( id ) )
+			return;
+		cefevent.type = CEF_TET_CANCELLED;
+		break;
+
+	default:
+		return;
+	}
+
+	mPendingTouchMoves.erase( id );
+	FlushInput();
+	SendTouchEvent( cefevent );
 }
 
-void CEFWrapper::ScheduleTexUpload( avg::MCTexturePtr texture )
+void CEFWrapper::SendTouchEvent( const CefTouchEvent& event )
 {
-	avg::GLContextManager::get()->scheduleTexUpload(texture, mRenderBitmap);
+	CefTouchEvent copy = event;
+	WithBrowser( [=]( CefRefPtr< CefBrowser > browser )
+		{
+			browser->GetHost()->SendTouchEvent( copy );
+		} );
 }
 
-void CEFWrapper::Resize( glm::uvec2 size )
+void CEFWrapper::CancelTouches()
 {
-	if( size.x == 0 || size.y == 0 )
+	mPendingTouchMoves.clear();
+	for( auto i = mTouches.begin(); i != mTouches.end(); ++i )
 	{
-		std::cerr << "Warning: Tried resize texture to 0" << std::endl;
+		i->second.type = CEF_TET_CANCELLED;
+		SendTouchEvent( i->second );
 	}
-	mSize = size;
-
-	// Only way to resize bitmap is to recreate it.
-	// shared_ptr should make sure there is no leak.
-	mRenderBitmap = avg::BitmapPtr(
-		new avg::Bitmap( glm::vec2((float)size.x, (float)size.y),
-			avg::B8G8R8A8 ) );
-
-	unsigned char* zerobuf = (unsigned char*)calloc( 4, size.x * size.y );
-	mRenderBitmap->setPixels( zerobuf );
-	free( zerobuf );
-
-	(*mBrowser)->GetHost()->WasResized();
+	mTouches.clear();
 }
 
-bool CEFWrapper::GetViewRect(
-	CefRefPtr<CefBrowser> browser, CefRect &rect )
+void CEFWrapper::SetTouchInput( bool touch )
 {
-	rect = CefRect( 0, 0, mSize.x, mSize.y );
-	return true;
+	if( !touch )
+		CancelTouches();
+	m_TouchInput = touch;
 }
 
-void CEFWrapper::OnPaint( CefRefPtr<CefBrowser> browser,
-							PaintElementType type,
-							const RectList &dirtyRects,
-							const void* buffer,
-							int width,
-							int height )
+void CEFWrapper::FlushInput()
 {
-	if( width != mRenderBitmap->getSize().x ||
-		height != mRenderBitmap->getSize().y )
+	if( mMovePending )
 	{
-		std::cerr << "Warning: texture size mismatch" << std::endl;
-		return;
+		CefMouseEvent move = mPendingMove;
+		WithBrowser( [=]( CefRefPtr< CefBrowser > browser )
+			{
+				browser->GetHost()->SendMouseMoveEvent( move, false );
+			} );
+		mMovePending = false;
 	}
 
-	mRenderBitmap->setPixels(static_cast< const unsigned char* >(buffer));
-}
+	if( mWheelPending )
+	{
+		CefMouseEvent wheel = mPendingWheel;
+		glm::ivec2 delta( mPendingWheelDelta );
+		WithBrowser( [=]( CefRefPtr< CefBrowser > browser )
+			{
+				browser->GetHost()->SendMouseWheelEvent( wheel, delta.x, delta.y );
+			} );
+		mPendingWheelDelta = glm::vec2( 0, 0 );
+		mWheelPending = false;
+	}
 
+	for( auto i = mPendingTouchMoves.begin(); i != mPendingTouchMoves.end(); ++i )
+		SendTouchEvent( i->second );
+	mPendingTouchMoves.clear();
+}
 
-void CEFWrapper::ProcessEvent( EventPtr ev, Node* cefnode )
+void CEFWrapper::ProcessKeyEvent( const KeyEvent& key )
 {
-	MouseEventPtr mouse = boost::dynamic_pointer_cast<MouseEvent>(ev);
-	MouseWheelEventPtr wheel = boost::dynamic_pointer_cast<MouseWheelEvent>(ev);
-	KeyEventPtr key = boost::dynamic_pointer_cast<KeyEvent>(ev);
-
-	if( m_MouseInput && mouse )
-	{
-		glm::vec2 coords = cefnode->getRelPos( mouse->getPos() );
-
-		CefMouseEvent cefevent;
-		cefevent.x = (int)coords.x;
-		cefevent.y = (int)coords.y;
-
-		CefBrowserHost::MouseButtonType btntype;
-		switch( mouse->getButton() )
-		{
-		case MouseEvent::LEFT_BUTTON:
-			btntype = MBT_LEFT;
-			cefevent.modifiers |= EVENTFLAG_LEFT_MOUSE_BUTTON;
-			break;
-		case MouseEvent::MIDDLE_BUTTON:
-			btntype = MBT_MIDDLE;
-			cefevent.modifiers |= EVENTFLAG_MIDDLE_MOUSE_BUTTON;
-			break;
-		case MouseEvent::RIGHT_BUTTON:
-			btntype = MBT_RIGHT;
-			cefevent.modifiers |= EVENTFLAG_RIGHT_MOUSE_BUTTON;
-			break;
-		}
+	FlushInput();
 
-		int type = mouse->getType();
-		if( type == Event::CURSOR_MOTION )
-		{
-			(*mBrowser)->GetHost()->SendMouseMoveEvent( cefevent, false );
-		}
-		else if( type == Event::CURSOR_UP || type == Event::CURSOR_DOWN )
-		{
-			bool mouseUp = type == Event::CURSOR_UP;
-			(*mBrowser)->GetHost()->
-				SendMouseClickEvent( cefevent, btntype, mouseUp, 1 );
-		}
-	} // if mouseevent
-
-	if( m_MouseInput && wheel )
-	{
-		CefMouseEvent cefevent;
-		glm::vec2 pos = cefnode->getRelPos( wheel->getPos() );
-		cefevent.x = (int)pos.x;
-		cefevent.y = (int)pos.y;
-
-		glm::vec2 motion = wheel->getMotion() * 40.0f;
-		(*mBrowser)->GetHost()->SendMouseWheelEvent(cefevent, (int)motion.x, (int)motion.y);
-	} // if wheelevent
-
-	if( key )
-	{
-		// Maps key names to Windows keycodes, as they are needed universally.
-		static std::map< std::string, int > KeyMap = boost::assign::map_list_of
-				("Return", 13)
-				("Keypad Enter", 13)
-				("Period", 190)
-				("Keypad .", 190)
-				("Backspace", 8)
-				("Tab", 9)
-				("Escape", 27)
-				("Left", 37)
-				("Up", 38)
-				("Right", 39)
-				("Down", 40)
-				("Home", 36)
-				("End", 35)
-				("PageUp", 33)
-				("PageDown", 34)
-				("Delete", 46)
-				("Divide", 111)
-				("Keypad /", 111)
-				("Multiply", 106)
-				("Keypad *", 106)
-				("Minus", 109)
-				("Keypad -", 109)
-				("Plus", 107)
-				("Keypad +", 107)
-				("Comma", 190)
-				("Left Shift", 16)
-				("Right Shift", 16)
-				("Left Ctrl", 17)
-				("Right Ctrl", 17)
-				("Left Alt", 18)
-				("Right Alt", 18)
-				("Left GUI", 91)
-				("Right GUI", 92)
-				("Menu", 93)
-				("Pause", 19)
-				("PrintScreen", 44)
-				("ScrollLock", 141)
-				("Numlock", 144)
-				("Insert", 45)
-				("CapsLock", 20)
-				("F1", 112)
-				("F2", 113)
-				("F3", 114)
-				("F4", 115)
-				("F5", 116)
-				("F6", 117)
-				("F7", 118)
-				("F8", 119)
-				("F9", 120)
-				("F10", 121)
-				("F11", 122)
-				("F12", 123)
-				("F13", 124)
-				("F14", 125)
-				("F15", 126)
-				("F16", 127)
-				("F17", 128)
-				("F18", 129)
-				("F19", 130)
-				("F20", 131)
-				("F21", 132)
-				("F22", 133)
-				("F23", 134)
-				("F24", 135)
-				("Space", 32)
-				("Keypad 0", 96)
-				("Keypad 1", 97)
-				("Keypad 2", 98)
-				("Keypad 3", 99)
-				("Keypad 4", 100)
-				("Keypad 5", 101)
-				("Keypad 6", 102)
-				("Keypad 7", 103)
-				("Keypad 8", 104)
-				("Keypad 9", 105);
-
-		CefKeyEvent evt;
-		evt.type = (key->getType() == Event::KEY_DOWN)
-						? KEYEVENT_RAWKEYDOWN : KEYEVENT_KEYUP;
-
-		std::wstring_convert<std::codecvt_utf8<char16_t>, char16_t> conv16;
-
-		// Try to map key avg name to windows vk keycode.
-		auto i = KeyMap.find( key->getName() );
-		int kc = 0;
-		if( i != KeyMap.end() )
-		{
-			kc = i->second;
-		}
-		else
-		{
-			// If we can't, just use UTF16 representation.
-			// This causes many errors on windows, but works well on linux.
-			std::u16string str16 = conv16.from_bytes(key->getName());
-			kc = str16[0];
-		}
+	CefKeyEvent evt;
+	evt.type = ( key.getType() == Event::KEY_DOWN )
+					? KEYEVENT_RAWKEYDOWN : KEYEVENT_KEYUP;
 
-		evt.windows_key_code = kc;
+	// Try to map key avg name to windows vk keycode.
+	const std::string& name = key.getName();
+	int kc = KeyMap::GetKeyCode( name );
+	if( kc == 0 )
+	{
+		// If we can't, just use UTF16 representation.
+		// This causes many errors on windows, but works well on linux.
+		kc = KeyMap::FirstUTF16( name );
+	}
 
+	evt.windows_key_code = kc;
 
-		int mod = key->getModifiers();
-		bool shift = (mod & KMOD_SHIFT) != 0;
-		bool ctrl = (mod & KMOD_CTRL) != 0;
-		bool alt = (mod & KMOD_ALT) != 0;
-		bool num_lock = !(mod & KMOD_NUM);
-		bool caps_lock = (mod & KMOD_CAPS) != 0;
 
-		int modifiers = 0;
-		if( shift )
-		{
-			modifiers += EVENTFLAG_SHIFT_DOWN;
-		}
+	int mod = key.getModifiers();
+	bool shift = (mod & KMOD_SHIFT) != 0;
+	bool ctrl = (mod & KMOD_CTRL) != 0;
+	bool alt = (mod & KMOD_ALT) != 0;
+	bool num_lock = !(mod & KMOD_NUM);
+	bool caps_lock = (mod & KMOD_CAPS) != 0;
 
-		if( ctrl )
-			modifiers += EVENTFLAG_CONTROL_DOWN;
+	int modifiers = 0;
+	if( shift )
+	{
+		modifiers += EVENTFLAG_SHIFT_DOWN;
+	}
 
-		if( alt )
-			modifiers += EVENTFLAG_ALT_DOWN;
+	if( ctrl )
+		modifiers += EVENTFLAG_CONTROL_DOWN;
 
-		if( num_lock )
-			modifiers += EVENTFLAG_NUM_LOCK_ON;
+	if( alt )
+		modifiers += EVENTFLAG_ALT_DOWN;
 
-		if( caps_lock )
-			modifiers += EVENTFLAG_CAPS_LOCK_ON;
+	if( num_lock )
+		modifiers += EVENTFLAG_NUM_LOCK_ON;
 
-		evt.modifiers = modifiers;
+	if( caps_lock )
+		modifiers += EVENTFLAG_CAPS_LOCK_ON;
 
+	evt.modifiers = modifiers;
 
-		UTF8String text = key->getText();
 
-		// This signals that key was pressed once.
-		evt.native_key_code = 0x00000001;
+	const UTF8String& text = key.getText();
 
+	// This signals that key was pressed once.
+	evt.native_key_code = 0x00000001;
 
-		// If there is text, send it as text.
-		if( text.size() )
-		{
-			std::u16string str16 = conv16.from_bytes(text);
 
-			evt.type = KEYEVENT_CHAR;
-			evt.character = str16[0];
-			evt.unmodified_character = str16[0];
+	// If there is text, send it as text.
+	char16_t character = KeyMap::FirstUTF16( text );
+	if( character )
+	{
+		evt.type = KEYEVENT_CHAR;
+		evt.character = character;
+		evt.unmodified_character = character;
 #ifdef _WIN32
-			evt.windows_key_code = str16[0];
+		evt.windows_key_code = character;
 #endif
-		}
-
-		(*mBrowser)->GetHost()->SendKeyEvent( evt );
 	}
+
+	WithBrowser( [=]( CefRefPtr< CefBrowser > browser )
+		{
+			browser->GetHost()->SendKeyEvent( evt );
+		} );
+}
+
+void CEFWrapper::AddJSCallback( std::string cmd, boost::python::object func,
+	int priority )
+{
+	JSCallback& cb = mJSCBs[cmd];
+	cb.mFunc = func;
+	cb.mPriority = priority;
 }
 
-void CEFWrapper::AddJSCallback( std::string cmd, boost::python::object func )
+int CEFWrapper::GetCallbackPriority( const std::string& cmd ) const
 {
-	mJSCBs[cmd] = func;
+	auto i = mJSCBs.find( cmd );
+	return i != mJSCBs.end() ? i->second.mPriority : 0;
 }
 
 void CEFWrapper::RemoveJSCallback( std::string cmd )
@@ -435,8 +1830,11 @@ void CEFWrapper::RemoveJSCallback( std::string cmd )
 
 void CEFWrapper::ExecuteJS( std::string command )
 {
-	CefRefPtr<CefFrame> frame = (*mBrowser)->GetMainFrame();
-	frame->ExecuteJavaScript( command, frame->GetURL(), 0 );
+	WithBrowser( [=]( CefRefPtr< CefBrowser > browser )
+		{
+			CefRefPtr<CefFrame> frame = browser->GetMainFrame();
+			frame->ExecuteJavaScript( command, frame->GetURL(), 0 );
+		} );
 }
 
 bool CEFWrapper::GetScrollbarsEnabled() const
@@ -444,112 +1842,395 @@ bool CEFWrapper::GetScrollbarsEnabled() const
 	return m_ScrollbarsEnabled;
 }
 
-void CEFWrapper::HideScrollbars( CefRefPtr<CefFrame> frame )
+void CEFWrapper::SetScrollbarsEnabled( bool scroll )
 {
-	frame->ExecuteJavaScript( "document.documentElement.style.overflow = 'hidden';",
-		frame->GetURL(), __LINE__ );
-	m_ScrollbarsEnabled = false;
+	m_ScrollbarsEnabled = scroll;
+	SendPageState();
 }
 
-void CEFWrapper::ShowScrollbars( CefRefPtr<CefFrame> frame )
+void CEFWrapper::SendPageState()
 {
-	frame->ExecuteJavaScript( "document.documentElement.style.overflow = 'auto';",
-		frame->GetURL(), __LINE__ );
-	m_ScrollbarsEnabled = true;
+	CefRefPtr< CefProcessMessage > m = CefProcessMessage::Create( PAGE_STATE_MESSAGE );
+	m->GetArgumentList()->SetDouble( 0, m_Volume );
+	m->GetArgumentList()->SetBool( 1, m_ScrollbarsEnabled );
+	WithBrowser( [=]( CefRefPtr< CefBrowser > browser )
+		{
+			browser->SendProcessMessage( PID_RENDERER, m );
+		} );
 }
 
-void CEFWrapper::SetScrollbarsEnabled( bool scroll )
+void CEFWrapper::SetVolume( double volume )
 {
-	if( scroll )
-		ShowScrollbars( (*mBrowser)->GetMainFrame() );
-	else
-		HideScrollbars( (*mBrowser)->GetMainFrame() );
+	m_Volume = volume;
+	SendPageState();
+}
+
+double CEFWrapper::GetVolume() const
+{
+	return m_Volume;
 }
 
-void CEFWrapper::SetVolumeInternal( CefRefPtr<CefFrame> frame, double volume )
+bool CEFWrapper::OnProcessMessageReceived(
+	CefRefPtr< CefBrowser > browser,
+	CefProcessId sender,
+	CefRefPtr< CefProcessMessage > message )
 {
-	std::stringstream script;
-	script << "var setvol = (function(){var volume = " << volume << ";\
-		var audionodes = document.getElementsByTagName('audio');\
-		for( var i = 0; i < audionodes.length; ++i )\
-		{\
-			audionodes[i].volume = volume;\
-		}\
-		var videonodes = document.getElementsByTagName('video');\
-		for( var i = 0; i < videonodes.length; ++i )\
-		{\
-			videonodes[i].volume = volume;\
-			}}); setvol();\
-		document.addEventListener('DOMContentLoaded', setvol, false);";
+	// Answered on the spot, the state is safe to read on any thread.
+	if( message->GetName() == PAGE_STATE_REQUEST )
+	{
+		SendPageState();
+		return true;
+	}
 
-	frame->ExecuteJavaScript( script.str(), frame->GetURL(), __LINE__ );
+	if( !mMultiThreaded )
+	{
+		DispatchMessages( browser, message );
+		return true;
+	}
 
-	m_Volume = volume;
+	// Callbacks are only known on the main thread. The message keeps
+	// its data alive until then.
+	RunOnMain( [=](){ DispatchMessages( browser, message ); } );
+	return true;
 }
 
-void CEFWrapper::SetVolume( double volume )
+/*! \brief Converts a message value to its Python equivalent. Binary data
+ * becomes bytes, dictionaries and lists dicts and lists. */
+static boost::python::object ToPython( CefRefPtr< CefValue > value )
 {
-	SetVolumeInternal( (*mBrowser)->GetMainFrame(), volume );
+	using namespace boost::python;
+	switch( value->GetType() )
+	{
+	case VTYPE_BOOL:
+		return object( value->GetBool() );
+	case VTYPE_INT:
+		return object( value->GetInt() );
+	case VTYPE_DOUBLE:
+		return object( value->GetDouble() );
+	case VTYPE_STRING:
+		return object( value->GetString().ToString() );
+	case VTYPE_BINARY:
+	{
+		CefRefPtr< CefBinaryValue > binary = value->GetBinary();
+		size_t size = binary->GetSize();
+#if PY_MAJOR_VERSION < 3
+		PyObject* bytes = PyString_FromStringAndSize( nullptr, size );
+		binary->GetData( PyString_AS_STRING( bytes ), size, 0 );
+#else
+		PyObject* bytes = PyBytes_FromStringAndSize( nullptr, size );
+		binary->GetData( PyBytes_AS_STRING( bytes ), size, 0 );
+#endif
+		return object( handle<>( bytes ) );
+	}
+	case VTYPE_DICTIONARY:
+	{
+		CefRefPtr< CefDictionaryValue > dict = value->GetDictionary();
+		CefDictionaryValue::KeyList keys;
+		dict->GetKeys( keys );
+		boost::python::dict result;
+		for( auto i = keys.begin(); i != keys.end(); ++i )
+			result[i->ToString()] = ToPython( dict->GetValue( *i ) );
+		return result;
+	}
+	case VTYPE_LIST:
+	{
+		CefRefPtr< CefListValue > list = value->GetList();
+		boost::python::list result;
+		for( size_t i = 0; i < list->GetSize(); ++i )
+			result.append( ToPython( list->GetValue( i ) ) );
+		return result;
+	}
+	default:
+		return object();
+	}
 }
 
-double CEFWrapper::GetVolume() const
+/*! \brief str() of a Python object as UTF-8. Python 2 unicode objects
+ * are encoded instead, str() fails on anything outside ASCII. */
+static std::string ToUTF8( const boost::python::object& obj )
 {
-	return m_Volume;
+	using namespace boost::python;
+#if PY_MAJOR_VERSION < 3
+	if( PyUnicode_Check( obj.ptr() ) )
+	{
+		handle<> utf8( PyUnicode_AsUTF8String( obj.ptr() ) );
+		return std::string( PyString_AS_STRING( utf8.get() ),
+			PyString_GET_SIZE( utf8.get() ) );
+	}
+#endif
+	return extract< std::string >( str( obj ) );
 }
 
-bool CEFWrapper::OnProcessMessageReceived(
-	CefRefPtr< CefBrowser > browser,
-	CefProcessId sender,
+/*! \brief Converts a Python object for a process message. bytes,
+ * bytearray and other buffers become binary data, sequences lists and
+ * dicts dictionaries with string keys. Anything else is sent as UTF-8
+ * text. */
+static CefRefPtr< CefValue > ToCefValue( const boost::python::object& obj,
+	int depth = 0 )
+{
+	using namespace boost::python;
+	CefRefPtr< CefValue > result = CefValue::Create();
+	PyObject* o = obj.ptr();
+	if( depth > MAX_VALUE_DEPTH )
+	{
+		std::cerr << "Warning: callJS argument nested too deeply." << std::endl;
+		result->SetNull();
+	}
+	else if( o == Py_None )
+	{
+		result->SetNull();
+	}
+	else if( PyBool_Check( o ) )
+	{
+		result->SetBool( o == Py_True );
+	}
+#if PY_MAJOR_VERSION < 3
+	else if( PyInt_Check( o ) || PyLong_Check( o ) )
+#else
+	else if( PyLong_Check( o ) )
+#endif
+	{
+		// Like JS numbers, ints beyond 32 bits are sent as double.
+		long long value = extract< long long >( obj );
+		if( value >= INT_MIN && value <= INT_MAX )
+			result->SetInt( (int)value );
+		else
+			result->SetDouble( (double)value );
+	}
+	else if( PyFloat_Check( o ) )
+	{
+		result->SetDouble( PyFloat_AsDouble( o ) );
+	}
+#if PY_MAJOR_VERSION < 3
+	else if( PyUnicode_Check( o ) )
+	{
+		result->SetString( ToUTF8( obj ) );
+	}
+	else if( PyBuffer_Check( o ) )
+	{
+		const void* data;
+		Py_ssize_t size;
+		if( PyObject_AsReadBuffer( o, &data, &size ) < 0 )
+			throw_error_already_set();
+		result->SetBinary( CefBinaryValue::Create( data, size ) );
+	}
+#else
+	else if( PyBytes_Check( o ) )
+	{
+		result->SetBinary( CefBinaryValue::Create( PyBytes_AS_STRING( o ),
+			PyBytes_GET_SIZE( o ) ) );
+	}
+#endif
+	else if( PyByteArray_Check( o ) )
+	{
+		result->SetBinary( CefBinaryValue::Create( PyByteArray_AS_STRING( o ),
+			PyByteArray_GET_SIZE( o ) ) );
+	}
+	else if( PyMemoryView_Check( o ) )
+	{
+		Py_buffer view;
+		if( PyObject_GetBuffer( o, &view, PyBUF_SIMPLE ) < 0 )
+			throw_error_already_set();
+		result->SetBinary( CefBinaryValue::Create( view.buf, view.len ) );
+		PyBuffer_Release( &view );
+	}
+	else if( PyList_Check( o ) || PyTuple_Check( o ) )
+	{
+		CefRefPtr< CefListValue > list = CefListValue::Create();
+		Py_ssize_t size = PySequence_Size( o );
+		list->SetSize( size );
+		for( Py_ssize_t i = 0; i < size; ++i )
+			list->SetValue( i, ToCefValue( obj[i], depth + 1 ) );
+		result->SetList( list );
+	}
+	else if( PyDict_Check( o ) )
+	{
+		CefRefPtr< CefDictionaryValue > dict = CefDictionaryValue::Create();
+		boost::python::list items = extract< boost::python::dict >( obj )().items();
+		for( Py_ssize_t i = 0; i < len( items ); ++i )
+		{
+			std::string key = ToUTF8( items[i][0] );
+			dict->SetValue( key, ToCefValue( items[i][1], depth + 1 ) );
+		}
+		result->SetDictionary( dict );
+	}
+	else
+	{
+		result->SetString( ToUTF8( obj ) );
+	}
+	return result;
+}
+
+void CEFWrapper::CallJS( const std::string& name, boost::python::object args )
+{
+	NoteActivity();
+
+	// Converted here, on the main thread, as it touches Python objects.
+	CefRefPtr< CefProcessMessage > m = CefProcessMessage::Create( CALL_MESSAGE );
+	m->GetArgumentList()->SetString( 0, name );
+	m->GetArgumentList()->SetValue( 1, ToCefValue( args ) );
+	WithBrowser( [=]( CefRefPtr< CefBrowser > browser )
+		{
+			browser->SendProcessMessage( PID_RENDERER, m );
+		} );
+}
+
+void CEFWrapper::DispatchMessages( CefRefPtr< CefBrowser > browser,
 	CefRefPtr< CefProcessMessage > message )
 {
 	std::string name = message->GetName();
+	CefRefPtr< CefListValue > args = message->GetArgumentList();
+
+	// Values are read when the callback runs, the captured message keeps
+	// them alive until then.
+	if( name == REQUEST_MESSAGE )
+	{
+		int id = args->GetInt( 0 );
+		std::string cmd = args->GetString( 1 );
+		Dispatch( GetCallbackPriority( cmd ), [=]()
+			{
+				AnswerRequest( browser, id, cmd,
+					message->GetArgumentList()->GetValue( 2 ) );
+			} );
+		return;
+	}
+
+	// Unbatched messages are a batch of one.
+	if( name != BATCH_MESSAGE )
+	{
+		Dispatch( GetCallbackPriority( name ), [=]()
+			{
+				CallJSCallback( name, message->GetArgumentList()->GetValue( 0 ) );
+			} );
+		return;
+	}
+	for( size_t i = 0; i + 1 < args->GetSize(); i += 2 )
+	{
+		std::string cmd = args->GetString( i );
+		Dispatch( GetCallbackPriority( cmd ), [=]()
+			{
+				CallJSCallback( cmd, message->GetArgumentList()->GetValue( i + 1 ) );
+			} );
+	}
+}
+
+/*! \brief Takes the pending Python exception and returns its message. */
+static std::string FetchPythonError()
+{
+	using namespace boost::python;
+	PyObject* type;
+	PyObject* value;
+	PyObject* trace;
+	PyErr_Fetch( &type, &value, &trace );
+	PyErr_NormalizeException( &type, &value, &trace );
+	handle<> htype( allow_null( type ) );
+	handle<> hvalue( allow_null( value ) );
+	handle<> htrace( allow_null( trace ) );
+	if( !hvalue )
+		return "Python error";
+	return extract< std::string >( str( object( hvalue ) ) );
+}
+
+void CEFWrapper::AnswerRequest( CefRefPtr< CefBrowser > browser, int id,
+	const std::string& cmd, CefRefPtr< CefValue > data )
+{
+	ScopeTimer timer( MessageProfilingZone );
+	mStats.AddMessage();
+
+	CefRefPtr< CefProcessMessage > m = CefProcessMessage::Create( RESPONSE_MESSAGE );
+	CefRefPtr< CefListValue > args = m->GetArgumentList();
+	args->SetInt( 0, id );
+	auto i = mJSCBs.find( cmd );
+	if( i == mJSCBs.end() )
+	{
+		args->SetBool( 1, false );
+		args->SetString( 2, "No callback for " + cmd );
+	}
+	else
+	{
+		try
+		{
+			CefRefPtr< CefValue > result =
+				ToCefValue( i->second.mFunc( ToPython( data ) ) );
+			args->SetBool( 1, true );
+			args->SetValue( 2, result );
+		}
+		catch( boost::python::error_already_set& )
+		{
+			args->SetBool( 1, false );
+			args->SetString( 2, FetchPythonError() );
+		}
+	}
 
-	auto i = mJSCBs.find( name );
+	// Renderers drop answers to ids they don't know, for example after
+	// the page navigated.
+	WithBrowser( [=]( CefRefPtr< CefBrowser > current )
+		{
+			current->SendProcessMessage( PID_RENDERER, m );
+		} );
+}
+
+bool CEFWrapper::CallJSCallback( const std::string& cmd, CefRefPtr< CefValue > data )
+{
+	ScopeTimer timer( MessageProfilingZone );
+	mStats.AddMessage();
+	auto i = mJSCBs.find( cmd );
 	if( i != mJSCBs.end() )
 	{
-		std::string data = message->GetArgumentList()->GetString( 0 );
-		i->second( data );
+		i->second.mFunc( ToPython( data ) );
 		return true;
 	}
 	else
 	{
-		std::cerr << "Warning: Couldn't find callback for cmd:" << name
+		std::cerr << "Warning: Couldn't find callback for cmd:" << cmd
 			<< std::endl;
 	}
 	return false;
 }
+
 void CEFWrapper::OnPluginCrashed(
 	CefRefPtr< CefBrowser > browser,
 	 const CefString& plugin_path )
 {
-	if( !mPluginCrashCB.is_none() )
-		mPluginCrashCB( plugin_path );
+	std::string path = plugin_path;
+	RunOnMain( [=]()
+		{
+			Dispatch( EVENT_PRIORITY, [=]()
+				{
+					if( !mPluginCrashCB.is_none() )
+						mPluginCrashCB( path );
+				} );
+		} );
 }
 
 void CEFWrapper::OnRenderProcessTerminated(
 	CefRefPtr< CefBrowser > browser,
 	CefRequestHandler::TerminationStatus status )
 {
-	if( !mRendererCrashCB.is_none() )
+	std::string sstatus;
+	switch( status )
 	{
-		std::string sstatus;
-		switch( status )
-		{
-		case TS_ABNORMAL_TERMINATION:
-			sstatus = "abnormal_exit";
-			break;
+	case TS_ABNORMAL_TERMINATION:
+		sstatus = "abnormal_exit";
+		break;
 
-		case TS_PROCESS_WAS_KILLED:
-			sstatus = "killed";
-			break;
+	case TS_PROCESS_WAS_KILLED:
+		sstatus = "killed";
+		break;
 
-		case TS_PROCESS_CRASHED:
-			sstatus = "crashed";
-			break;
-		}
-
-		mRendererCrashCB( sstatus );
+	case TS_PROCESS_CRASHED:
+		sstatus = "crashed";
+		break;
 	}
+
+	RunOnMain( [=]()
+		{
+			Dispatch( EVENT_PRIORITY, [=]()
+				{
+					if( !mRendererCrashCB.is_none() )
+						mRendererCrashCB( sstatus );
+				} );
+		} );
 }
 
 void CEFWrapper::OnLoadingStateChange(
@@ -558,25 +2239,42 @@ void CEFWrapper::OnLoadingStateChange(
 	bool canGoBack,
 	bool canGoForward )
 {
-	// Just in case something turns volume back on during loading.
-	SetVolumeInternal( browser->GetMainFrame(), m_Volume );
-	if( !isLoading && !mLoadEndCB.is_none() )
-		mLoadEndCB();
+	if( !isLoading )
+	{
+		// Tells the load end of Recycle()'s page from one of the page before.
+		bool blank = browser->GetMainFrame()->GetURL().ToString() == BLANK_URL;
+		RunOnMain( [=]()
+			{
+				if( mBlankPending )
+				{
+					if( blank )
+						mBlankPending = false;
+					return;
+				}
+				Dispatch( EVENT_PRIORITY, [=]()
+					{
+						if( !mLoadEndCB.is_none() )
+							mLoadEndCB();
+					} );
+			} );
+	}
 }
 
-void CEFWrapper::OnLoadStart( 
-		CefRefPtr< CefBrowser > browser,
-		CefRefPtr< CefFrame > frame,
-		TransitionType transition_type )
+void CEFWrapper::OnBeforeClose( CefRefPtr< CefBrowser > browser )
 {
-	if( !m_ScrollbarsEnabled )
-		HideScrollbars( frame );
+	if( mBrowser && *mBrowser && (*mBrowser)->IsSame( browser ) )
+		Deinit();
 }
 
-void CEFWrapper::OnBeforeClose( CefRefPtr< CefBrowser > browser )
+void CEFWrapper::OnAfterCreated( CefRefPtr< CefBrowser > browser )
 {
-	if( (*mBrowser)->IsSame( browser ) )
-		Deinit();
+	if( !mMultiThreaded || !mBrowser || *mBrowser )
+		return;
+
+	*mBrowser = browser;
+	for( auto i = mPendingUITasks.begin(); i != mPendingUITasks.end(); ++i )
+		(*i)( browser );
+	mPendingUITasks.clear();
 }
 
 #endif
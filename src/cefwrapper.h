@@ -3,17 +3,26 @@
 
 #include <unordered_map>
 #include <map>
+#include <set>
+#include <functional>
+#include <memory>
+#include <random>
+#include <atomic>
+#include <climits>
+#include <deque>
+#include <queue>
 
 #include <iostream>
 #include <string>
-#include <locale>
-#include <codecvt>
+#include <cstring>
+#include <vector>
 
 
 #include <include/cef_render_handler.h>
 #include <include/cef_life_span_handler.h>
 #include <include/cef_client.h>
 #include <include/cef_app.h>
+#include <include/cef_browser_process_handler.h>
 
 #include "ini.hpp"
 
@@ -22,16 +31,88 @@ namespace avg
 
 /*! \brief Used to add javascript bindings on the renderer process.
 	Should be allocated and passed to CefExecuteProcess, CefInitialize in main.*/
-class CEFApp : public ::CefApp, CefV8Handler, CefRenderProcessHandler
+class CEFApp : public ::CefApp, CefV8Handler, CefRenderProcessHandler,
+	CefBrowserProcessHandler
 {
 private:
 	bool mMainInstance;
 	bool mAudioMuted;
+	bool mExternalBeginFrame;
 	INI::Level mAdditionalArguments;
 
+	std::function< void( int64 ) > mScheduleWorkCB;
+
+	// Renderer side. avg.send messages waiting to be sent as one process
+	// message, per browser. Only touched on the renderer thread.
+	struct Message
+	{
+		std::string mCmd;
+		CefRefPtr< CefValue > mData;
+		size_t mBytes;
+	};
+	struct Batch
+	{
+		Batch() : mBytes( 0 ) {}
+
+		std::vector< Message > mMessages;
+		size_t mBytes;
+		// Commands where only the newest queued message is kept.
+		std::set< std::string > mCoalesced;
+	};
+	std::map< int, Batch > mBatches;
+
+	// Renderer side. Functions pages registered with avg.expose, per
+	// browser, with the context they belong to.
+	struct Exposed
+	{
+		CefRefPtr< CefV8Context > mContext;
+		CefRefPtr< CefV8Value > mFunc;
+	};
+	std::map< int, std::map< std::string, Exposed > > mExposed;
+
+	void CallExposed( CefRefPtr< CefBrowser > browser,
+		CefRefPtr< CefListValue > args );
+
+	// Renderer side. avg.request promises waiting for Python, by id.
+	struct Request
+	{
+		int mBrowser;
+		CefRefPtr< CefV8Context > mContext;
+		CefRefPtr< CefV8Value > mResolve;
+		CefRefPtr< CefV8Value > mReject;
+	};
+	std::map< int, Request > mRequests;
+	int mNextRequest;
+
+	/*! \brief Settles a request with value, or rejects it with error if
+	 * ok is false. Does nothing if it was settled already. */
+	void SettleRequest( int id, bool ok, CefRefPtr< CefV8Value > value );
+
+	// Renderer side. Volume and scrollbar state of each browser, once
+	// the browser sent it, and the function the extension registered in
+	// its main frame to apply it.
+	struct PageState
+	{
+		PageState() : mKnown( false ), mVolume( 1.0 ), mScrollbars( true ) {}
+
+		bool mKnown;
+		double mVolume;
+		bool mScrollbars;
+		CefRefPtr< CefV8Context > mContext;
+		CefRefPtr< CefV8Value > mApply;
+	};
+	std::map< int, PageState > mPageStates;
+
+	/*! \brief Applies state to its page if both are there. */
+	void ApplyPageState( PageState& state );
+
+	void Queue( CefRefPtr< CefBrowser > browser, const std::string& cmd,
+		CefRefPtr< CefValue > data, size_t bytes );
+	void Flush( CefRefPtr< CefBrowser > browser );
+
 public:
 	CEFApp();
-	CEFApp( bool audiomuted, const INI::Level& level );
+	CEFApp( bool audiomuted, bool externalbeginframe, const INI::Level& level );
 
 	/*! \brief Returns self as RenderProcessHandler to set JS extensions.
 		* Inherited from CefApp. */
@@ -40,6 +121,24 @@ public:
 		return this;
 	}
 
+	/*! \brief Returns self to receive message pump requests.
+		* Inherited from CefApp. */
+	CefRefPtr< CefBrowserProcessHandler > GetBrowserProcessHandler()
+	{
+		return this;
+	}
+
+	/*! \brief Sets where OnScheduleMessagePumpWork is forwarded to.
+		* Called from any thread. */
+	void SetScheduleWorkCB( const std::function< void( int64 ) >& cb )
+	{
+		mScheduleWorkCB = cb;
+	}
+
+	/*! \brief Asks for CefDoMessageLoopWork in delay_ms.
+		* Inherited from CefBrowserProcessHandler. */
+	void OnScheduleMessagePumpWork( int64 delay_ms );
+
 	/*! \brief Sets normally command-line options.
 		* Inherited from CefApp.*/
 	void OnBeforeCommandLineProcessing( const CefString& process_type,
@@ -49,6 +148,21 @@ public:
 		* Inherited from CefRenderProcessHandler. */
 	void OnWebKitInitialized();
 
+	/*! \brief Sends what the page queued before it goes away.
+		* Inherited from CefRenderProcessHandler. */
+	void OnContextReleased( CefRefPtr< CefBrowser > browser,
+		CefRefPtr< CefFrame > frame, CefRefPtr< CefV8Context > context );
+
+	/*! \brief Drops pending requests of a closed browser.
+		* Inherited from CefRenderProcessHandler. */
+	void OnBrowserDestroyed( CefRefPtr< CefBrowser > browser );
+
+	/*! \brief Handles callJS, avg.request responses and page state from the
+		* browser process.
+		* Inherited from CefRenderProcessHandler. */
+	bool OnProcessMessageReceived( CefRefPtr< CefBrowser > browser,
+		CefProcessId source_process, CefRefPtr< CefProcessMessage > message );
+
 	/*! \brief Executes native implemented JS functions.
 		* Inherited from CefV8Handler. */
 	bool Execute(
@@ -68,21 +182,37 @@ public:
 #include <SDL2/SDL_keycode.h>
 #include <glm/glm.hpp>
 
-#include <boost/assign.hpp>
-
 //#include <base/Logger.h>
 
 #include <player/Player.h>
 #include <player/OGLSurface.h>
 #include <player/MouseEvent.h>
 #include <player/MouseWheelEvent.h>
+#include <player/TouchEvent.h>
 #include <player/KeyEvent.h>
 #include <player/Node.h>
 
+#include <base/ProfilingZone.h>
+#include <base/ScopeTimer.h>
+#include <base/TimeSource.h>
+
 #include <graphics/GLContextManager.h>
+#include <graphics/GLContext.h>
+#include <graphics/MCTexture.h>
 #include <graphics/OGLHelper.h>
 #include <graphics/Bitmap.h>
 
+#include "copypool.h"
+#include "dirtyregion.h"
+#include "frameslot.h"
+#include "keymap.h"
+#include "messagepump.h"
+#include "nodestats.h"
+#include "pboring.h"
+#include "spscqueue.h"
+#include "surfacepool.h"
+#include "tilediff.h"
+
 namespace avg
 {
 
@@ -95,7 +225,13 @@ class CEFWrapper : public CefClient, CefLoadHandler, CefRequestHandler,
 private:
 
 	// List of callbacks based on cmd passed to avg.send in JS.
-	std::unordered_map< std::string, boost::python::object > mJSCBs;
+	struct JSCallback
+	{
+		boost::python::object mFunc;
+		int mPriority;
+	};
+	std::unordered_map< std::string, JSCallback > mJSCBs;
+	int GetCallbackPriority( const std::string& cmd ) const;
 
 	boost::python::object mLoadEndCB;
 	boost::python::object mPluginCrashCB;
@@ -105,8 +241,150 @@ private:
 	void Deinit();
 
 
+	// View size and the size of the bitmap and texture backing it.
+	// Capacity is at least size and only changes when the node outgrows it.
 	glm::uvec2 mSize;
+	glm::uvec2 mCapacity;
 	avg::BitmapPtr mRenderBitmap;
+	// mSize for GetViewRect, which may run on CEF's UI thread.
+	std::atomic< unsigned long long > mViewSize;
+	// CEF paints premultiplied alpha, libavg blends straight alpha.
+	bool mTransparent;
+
+	// WasResized() is sent at most once per mResizeInterval ms.
+	bool mResizePending;
+	long long mResizeInterval;
+	long long mLastResizeTime;
+	void FlushResize();
+
+	// Parts of mRenderBitmap that changed since the last texture upload.
+	DirtyRegion mDirtyRegion;
+	// Only used on GLES, which can't upload rects with a row stride.
+	std::vector< unsigned char > mPackBuffer;
+
+	int mLastBytesSaved;
+	long long mTotalBytesSaved;
+
+	// Optionally drops reported tiles whose content didn't change.
+	bool mTileDiffEnabled;
+	TileDiff mTileDiff;
+	long long mReportedDirtyBytes;
+	long long mChangedDirtyBytes;
+
+	// Incremented whenever mRenderBitmap changes.
+	unsigned mFrameGeneration;
+
+	NodeStats mStats;
+	// Arrival of the newest paint not uploaded yet in us, 0 if none.
+	long long mPaintTime;
+	void NoteUpload( long long bytes );
+
+	// Requested frame rate and the one currently set on the host, which is
+	// lower while the adaptive mode considers the page idle.
+	int mFrameRate;
+	int mActiveFrameRate;
+	bool mAdaptiveFrameRate;
+	long long mLastActivityTime;
+	void NoteActivity();
+	void ApplyFrameRate( int rate );
+
+	bool mHidden;
+
+	// Set by Recycle() until its blank page finished loading. Load ends
+	// until then are not reported, including those of the page before.
+	// Main thread only.
+	bool mBlankPending;
+
+	// External begin-frames: one is sent per libavg frame, limited to the
+	// active frame rate. mUpdateCount counts libavg frames.
+	bool mExternalBeginFrame;
+	unsigned mUpdateCount;
+	long long mLastBeginFrameTime;
+	// Oldest begin-frame not answered by a paint yet, 0 if none.
+	unsigned mBeginFrameSent;
+	long long mLateFrames;
+	void SendBeginFrame();
+
+	// Multi-threaded message loop mode. CEF calls the handlers on its UI
+	// thread, which hands paints over through mFrameSlot and everything
+	// else as tasks through mMainTasks. Update() picks both up on the main
+	// thread. mBrowser is then only touched on the UI thread.
+	bool mMultiThreaded;
+	FrameSlot mFrameSlot;
+	SPSCQueue< std::function< void() > > mMainTasks;
+	// UI thread only. Tasks waiting for mMainTasks to have room, in order.
+	std::deque< std::function< void() > > mMainOverflow;
+	bool mOverflowDrainPosted;
+	void PostOverflowDrain();
+	// UI thread only. Browser calls made before the browser existed.
+	std::vector< std::function< void( CefRefPtr< CefBrowser > ) > > mPendingUITasks;
+
+	/*! \brief Calls func with the browser if there is one. In multi-threaded
+	 * mode this happens later on CEF's UI thread. */
+	void WithBrowser( const std::function< void( CefRefPtr< CefBrowser > ) >& func );
+	/*! \brief Runs func on the main thread, right away unless multi-threaded. */
+	void RunOnMain( const std::function< void() >& func );
+	void RunMainTasks();
+
+	/*! \brief Calls the callbacks for an avg.send message or batch. */
+	void DispatchMessages( CefRefPtr< CefBrowser > browser,
+		CefRefPtr< CefProcessMessage > message );
+	/*! \brief Calls the callback for an avg.request and sends back its
+	 * return value or exception. */
+	void AnswerRequest( CefRefPtr< CefBrowser > browser, int id,
+		const std::string& cmd, CefRefPtr< CefValue > data );
+
+	// Python callbacks for CEF events and messages wait here until Update()
+	// runs them within the frame's dispatch budget. Higher priorities run
+	// first, equal ones in the order they were queued.
+	struct DispatchTask
+	{
+		int mPriority;
+		unsigned long long mSeq;
+		// When it was queued in us.
+		long long mTime;
+		std::function< void() > mFunc;
+
+		// std::priority_queue runs the largest first.
+		bool operator<( const DispatchTask& other ) const
+		{
+			if( mPriority != other.mPriority )
+				return mPriority < other.mPriority;
+			return mSeq > other.mSeq;
+		}
+	};
+	std::priority_queue< DispatchTask > mDispatchQueue;
+	unsigned long long mDispatchSeq;
+	/*! \brief Queues func to run on a later Update(). Main thread only. */
+	void Dispatch( int priority, const std::function< void() >& func );
+	/*! \brief Runs queued callbacks until MessagePump's dispatch budget is
+	 * used up, but at least one. The rest waits for the next frame. */
+	void RunDispatchQueue();
+
+	/*! \brief Copies the dirty parts of a full frame into the upload path.
+	 * painttime is when CEF delivered it, in us. */
+	void ApplyPaint( const unsigned char* src, int width, int height,
+		const DirtyRegion& dirty, long long painttime );
+	bool CallJSCallback( const std::string& cmd, CefRefPtr< CefValue > data );
+
+	// Streaming upload. While mStreaming is set, OnPaint writes into
+	// mPBORing instead of mRenderBitmap, which is then left stale.
+	PBORing mPBORing;
+	int mPBOCount;
+	bool mStreaming;
+
+	/*! \brief Gives the bitmap back to the pool and frees the ring.
+	 * Main thread only, the ring needs the GL context. */
+	void ReleaseSurfaces();
+
+	// Tiled backing. Streaming is off then, as the ring feeds one texture.
+	bool mTiled;
+
+	void UploadBitmapRects( avg::GLContext* context, avg::MCTexturePtr texture );
+	/*! \brief Uploads rects of mRenderBitmap to texture, which holds the
+	 * part of the bitmap starting at origin. */
+	void UploadRects( avg::GLContext* context, avg::MCTexturePtr texture,
+		const std::vector< CefRect >& rects, int originx, int originy );
 
 	// May refer back to us, which causes a cyclic dependence.
 	// We break it by using a pointer to a refptr. Ugly but works.
@@ -114,32 +392,138 @@ private:
 
 	bool m_MouseInput;
 
-	bool m_ScrollbarsEnabled;
-
-	double m_Volume;
-
-	void HideScrollbars( CefRefPtr< CefFrame > Frame );
-	void ShowScrollbars( CefRefPtr< CefFrame > Frame );
-
-	void SetVolumeInternal( CefRefPtr< CefFrame > Frame, double volume );
+	// Mouse moves and wheel turns are merged until FlushInput() sends
+	// them once per frame. Clicks and keys flush them first, so the
+	// browser gets everything in order.
+	bool mMovePending;
+	CefMouseEvent mPendingMove;
+	bool mWheelPending;
+	CefMouseEvent mPendingWheel;
+	glm::vec2 mPendingWheelDelta;
+
+	bool m_TouchInput;
+	// Contacts the browser saw pressed, with their last event, and the
+	// newest move of each since the last FlushInput().
+	std::map< int, CefTouchEvent > mTouches;
+	std::map< int, CefTouchEvent > mPendingTouchMoves;
+
+	void ProcessMouseEvent( const avg::MouseEvent& mouse, avg::Node* cefnode );
+	void ProcessWheelEvent( const avg::MouseWheelEvent& wheel, avg::Node* cefnode );
+	void ProcessTouchEvent( const avg::CursorEvent& touch, avg::Node* cefnode );
+	void ProcessKeyEvent( const avg::KeyEvent& key );
+	void FlushInput();
+	void SendTouchEvent( const CefTouchEvent& event );
+	/*! \brief Ends all contacts the browser saw pressed. */
+	void CancelTouches();
+
+	// Also read on the UI thread when a renderer asks for them.
+	std::atomic< bool > m_ScrollbarsEnabled;
+	std::atomic< double > m_Volume;
+
+	/*! \brief Sends volume and scrollbar state to the renderer, which
+	 * applies it to the current and later pages. */
+	void SendPageState();
 
 public:
 
 	CEFWrapper();
 	virtual ~CEFWrapper(){ }
 
-	void Init( glm::uvec2 res, bool transparent );
+	/*! \brief Creates the browser.
+	 * With externalbeginframe, paints are triggered from Update() instead
+	 * of Chromium's own timer. Needs enable-begin-frame-scheduling.
+	 * multithreaded must match multi_threaded_message_loop of CEF. */
+	void Init( glm::uvec2 res, bool transparent, int framerate,
+		bool externalbeginframe, bool multithreaded );
 	void Close();
+	/*! \brief Drops all Python callbacks. Must run on the main thread. */
+	void ClearCallbacks();
+	/*! \brief Moves the Python callbacks of other over, replacing ours. */
+	void TakeCallbacks( CEFWrapper& other );
+
+	/*! \brief Readies the browser for another node: drops callbacks,
+	 * input and surfaces, hides it and loads a blank page. */
+	void Recycle();
+	/*! \brief Whether the blank page of the last Recycle() finished loading. */
+	bool IsBlank() const { return !mBlankPending; }
+
+	bool GetTransparent() const { return mTransparent; }
 
 
 	void SetMouseInput(bool mouse){ m_MouseInput = mouse; }
+	/*! \brief Forwards touch contacts as native touch events. Turning it
+	 * off cancels the contacts in progress. */
+	void SetTouchInput( bool touch );
+
+	/*! \brief Streams paints through a ring of buffercount mapped PBOs.
+	 * 0 uses the Bitmap path. Falls back to it if PBOs aren't available. */
+	void SetStreamingUpload( int buffercount ){ mPBOCount = buffercount; }
 
 	void LoadURL( std::string url );
 	void Refresh();
 
 	void Update();
+
+	/*! \brief Uploads pending changes to texture.
+	 * Large changes are scheduled as a full upload via GLContextManager,
+	 * small ones are kept for UploadDirtyRects. */
 	void ScheduleTexUpload( avg::MCTexturePtr texture );
-	void Resize( glm::uvec2 size );
+
+	/*! \brief Uploads only the changed rects. Needs a current GL context. */
+	void UploadDirtyRects( avg::GLContext* context, avg::MCTexturePtr texture );
+
+	/*! \brief Switches to uploads into a grid of textures via UploadTiles. */
+	void SetTiledUpload( bool tiled );
+	/*! \brief Uploads the changed rects into the tiles they touch.
+	 * tiles is a row-major grid of tilesize textures, smaller at the right
+	 * and bottom edges. Needs a current GL context. */
+	void UploadTiles( avg::GLContext* context,
+		const std::vector< avg::MCTexturePtr >& tiles, int tilesize );
+
+	/*! \brief Bytes the last upload saved compared to a full upload. */
+	int GetLastUploadBytesSaved() const { return mLastBytesSaved; }
+	long long GetUploadBytesSaved() const { return mTotalBytesSaved; }
+
+	/*! \brief Counters since creation or the last ResetStats(). */
+	const NodeStats& GetStats() const { return mStats; }
+	void ResetStats();
+	/*! \brief Python callbacks waiting for the dispatch budget. */
+	size_t GetDispatchQueueDepth() const { return mDispatchQueue.size(); }
+
+	/*! \brief Compares tile hashes to find what really changed in a paint. */
+	void SetTileDiff( bool enabled );
+	bool GetTileDiff() const { return mTileDiffEnabled; }
+	/*! \brief Bytes CEF reported as dirty and bytes that really changed.
+	 * Equal unless tile diffing is on. */
+	long long GetReportedDirtyBytes() const { return mReportedDirtyBytes; }
+	long long GetChangedDirtyBytes() const { return mChangedDirtyBytes; }
+
+	/*! \brief Sets the view size.
+	 * Bitmap and texture storage is only reallocated when capacity changes,
+	 * otherwise the view is rendered into the top left part of it. */
+	void Resize( glm::uvec2 size, glm::uvec2 capacity );
+	void SetResizeInterval( long long ms ){ mResizeInterval = ms; }
+
+	/*! \brief Sets the maximum rate CEF paints at, 1 to 60. */
+	void SetFrameRate( int rate );
+	int GetFrameRate() const { return mFrameRate; }
+
+	/*! \brief Drops to a low frame rate while nothing gets painted.
+	 * Input and new paints bring the full rate back. */
+	void SetAdaptiveFrameRate( bool adaptive );
+	bool GetAdaptiveFrameRate() const { return mAdaptiveFrameRate; }
+
+	/*! \brief Tells the browser whether it is shown.
+	 * Hidden browsers stop painting and throttle their timers. */
+	void SetHidden( bool hidden );
+	bool IsHidden() const { return mHidden; }
+
+	/*! \brief Paints that arrived more than a frame after their begin-frame. */
+	long long GetLateFrames() const { return mLateFrames; }
+
+	/*! \brief Changes with every new frame from OnPaint or Resize.
+	 * Compare against the last consumed value to see if an upload is needed. */
+	unsigned GetFrameGeneration() const { return mFrameGeneration; }
 
 	void ProcessEvent( avg::EventPtr ev, avg::Node* cefnode );
 
@@ -147,13 +531,20 @@ public:
 	/*! \brief Used to receive data from avg.send in JS.
 	 * \param cmd Command name to forward.
 	 * When avg.send is called with cmd param == cmd then the data param
-	 * is forwarded along with the userdata to the given callback function. */
-	void AddJSCallback( std::string cmd, boost::python::object function );
+	 * is forwarded along with the userdata to the given callback function.
+	 * \param priority Queued messages of higher priority are dispatched first. */
+	void AddJSCallback( std::string cmd, boost::python::object function,
+		int priority = 0 );
 
 	void RemoveJSCallback( std::string cmd );
 
 	void ExecuteJS( std::string command );
 
+	/*! \brief Calls the function the page registered as name with
+	 * avg.expose. args is a Python sequence, converted like avg.send data
+	 * the other way round. No script is compiled for this. */
+	void CallJS( const std::string& name, boost::python::object args );
+
 
 	void SetLoadEndCB( boost::python::object callable )
 	{
@@ -228,6 +619,8 @@ public:
 	/// CefLifeSpanHandler inherited functions
 	// Used to know when to free browser instance
 	void OnBeforeClose( CefRefPtr< CefBrowser > browser ) OVERRIDE;
+	// Only used in multi-threaded mode, where browsers are created async.
+	void OnAfterCreated( CefRefPtr< CefBrowser > browser ) OVERRIDE;
 	///*************************************************
 
 	///*************************************************
@@ -250,12 +643,6 @@ public:
 		bool canGoBack,
 		bool canGoForward ) OVERRIDE;
 
-	// Used to inject JS into page before loading.
-	void OnLoadStart( 
-		CefRefPtr< CefBrowser > browser,
-		CefRefPtr< CefFrame > frame,
-		TransitionType transition_type) OVERRIDE;
-
 	///*************************************************
 
 	IMPLEMENT_REFCOUNTING( CEFWrapper );
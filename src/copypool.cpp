@@ -0,0 +1,150 @@
+#include "copypool.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace avg
+{
+
+// Copies smaller than this aren't worth a trip through the queue.
+static const int MIN_PARALLEL_BYTES = 64 * 1024;
+// Lower bound for the height of a row band.
+static const int MIN_BAND_ROWS = 16;
+
+CopyPool::CopyPool() : mStopping( false )
+{}
+
+CopyPool& CopyPool::Get()
+{
+	// Never destroyed, workers are joined in Stop().
+	static CopyPool* pool = new CopyPool();
+	return *pool;
+}
+
+void CopyPool::Start( int threads )
+{
+	Stop();
+
+	mStopping = false;
+	for( int i = 0; i < threads; ++i )
+		mThreads.push_back( std::thread( &CopyPool::WorkerMain, this ) );
+}
+
+void CopyPool::Stop()
+{
+	{
+		std::unique_lock< std::mutex > lock( mMutex );
+		mStopping = true;
+	}
+	mJobCond.notify_all();
+
+	for( auto i = mThreads.begin(); i != mThreads.end(); ++i )
+		i->join();
+	mThreads.clear();
+}
+
+void CopyPool::CopyRect( const unsigned char* src, int srcstride,
+	unsigned char* dst, int dststride, const CefRect& rect, int bpp,
+	PixelKernels::RowFunc convert )
+{
+	src += rect.y * srcstride + rect.x * bpp;
+	dst += rect.y * dststride + rect.x * bpp;
+	for( int y = 0; y < rect.height; ++y )
+	{
+		if( convert )
+			convert( src, dst, rect.width );
+		else
+			memcpy( dst, src, rect.width * bpp );
+		src += srcstride;
+		dst += dststride;
+	}
+}
+
+void CopyPool::CopyRegion( const unsigned char* src, int srcstride,
+	unsigned char* dst, int dststride, const DirtyRegion& region,
+	Fence& fence, PixelKernels::RowFunc convert )
+{
+	const std::vector< CefRect >& rects = region.GetRects();
+	int workers = GetThreadCount() + 1;
+
+	for( auto i = rects.begin(); i != rects.end(); ++i )
+	{
+		CefRect rect = *i;
+		if( mThreads.empty() || rect.width * rect.height * 4 < MIN_PARALLEL_BYTES )
+		{
+			CopyRect( src, srcstride, dst, dststride, rect, 4, convert );
+			continue;
+		}
+
+		int bandrows = std::max( MIN_BAND_ROWS,
+			( rect.height + workers - 1 ) / workers );
+		for( int y = 0; y < rect.height; y += bandrows )
+		{
+			CefRect band( rect.x, rect.y + y, rect.width,
+				std::min( bandrows, rect.height - y ) );
+			Submit( [=]()
+				{
+					CopyRect( src, srcstride, dst, dststride, band, 4, convert );
+				}, fence );
+		}
+	}
+}
+
+void CopyPool::Submit( const std::function< void() >& job, Fence& fence )
+{
+	if( mThreads.empty() )
+	{
+		job();
+		return;
+	}
+
+	++fence.mPending;
+	{
+		std::unique_lock< std::mutex > lock( mMutex );
+		Job j = { job, &fence };
+		mJobs.push_back( j );
+	}
+	mJobCond.notify_one();
+}
+
+void CopyPool::Wait( Fence& fence )
+{
+	std::unique_lock< std::mutex > lock( mMutex );
+	while( !fence.IsDone() )
+	{
+		if( !RunOne( lock ) )
+			mDoneCond.wait( lock );
+	}
+}
+
+bool CopyPool::RunOne( std::unique_lock< std::mutex >& lock )
+{
+	if( mJobs.empty() )
+		return false;
+
+	Job job = mJobs.front();
+	mJobs.pop_front();
+
+	lock.unlock();
+	job.mFunc();
+	lock.lock();
+
+	--job.mFence->mPending;
+	mDoneCond.notify_all();
+	return true;
+}
+
+void CopyPool::WorkerMain()
+{
+	std::unique_lock< std::mutex > lock( mMutex );
+	while( true )
+	{
+		if( RunOne( lock ) )
+			continue;
+		if( mStopping )
+			return;
+		mJobCond.wait( lock );
+	}
+}
+
+} // namespace avg
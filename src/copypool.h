@@ -0,0 +1,82 @@
+#ifndef COPYPOOL_H
+#define COPYPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "dirtyregion.h"
+#include "pixelkernels.h"
+
+namespace avg
+{
+
+/*! \brief Process-wide pool of worker threads for frame copies.
+ * Copies are split into row bands and spread over the workers. With 0
+ * threads everything runs on the calling thread. */
+class CopyPool
+{
+public:
+	/*! \brief Completion counter for a batch of jobs. */
+	class Fence
+	{
+	public:
+		Fence() : mPending( 0 ) {}
+		bool IsDone() const { return mPending == 0; }
+
+	private:
+		friend class CopyPool;
+		std::atomic< int > mPending;
+	};
+
+	static CopyPool& Get();
+
+	void Start( int threads );
+	void Stop();
+	int GetThreadCount() const { return (int)mThreads.size(); }
+
+	/*! \brief Queues copies of the rects of region from src to dst.
+	 * Both images are 4 bytes per pixel. Rows are passed through convert
+	 * if given. Wait on fence before touching either of them. */
+	void CopyRegion( const unsigned char* src, int srcstride,
+		unsigned char* dst, int dststride, const DirtyRegion& region,
+		Fence& fence, PixelKernels::RowFunc convert = nullptr );
+
+	void Submit( const std::function< void() >& job, Fence& fence );
+
+	/*! \brief Blocks until all jobs of fence ran. Helps out with queued
+	 * jobs in the meantime. */
+	void Wait( Fence& fence );
+
+	/*! \brief Copies rect, through convert if given, which needs bpp 4. */
+	static void CopyRect( const unsigned char* src, int srcstride,
+		unsigned char* dst, int dststride, const CefRect& rect, int bpp,
+		PixelKernels::RowFunc convert = nullptr );
+
+private:
+	struct Job
+	{
+		std::function< void() > mFunc;
+		Fence* mFence;
+	};
+
+	CopyPool();
+
+	void WorkerMain();
+	bool RunOne( std::unique_lock< std::mutex >& lock );
+
+	std::vector< std::thread > mThreads;
+	std::deque< Job > mJobs;
+	std::mutex mMutex;
+	std::condition_variable mJobCond;
+	std::condition_variable mDoneCond;
+	bool mStopping;
+};
+
+} // namespace avg
+
+#endif
@@ -0,0 +1,200 @@
+#include "dirtyregion.h"
+
+#include <algorithm>
+
+namespace avg
+{
+
+// Rough cost of one extra upload call, expressed in pixels.
+// Two rects are merged when their bounding box wastes less than this.
+static const int MERGE_SLACK = 64 * 64;
+
+// Past this many rects the bounding box is always cheaper.
+static const size_t MAX_RECTS = 16;
+
+static int Area( const CefRect& r )
+{
+	return r.width * r.height;
+}
+
+static CefRect Union( const CefRect& a, const CefRect& b )
+{
+	int x = std::min( a.x, b.x );
+	int y = std::min( a.y, b.y );
+	int r = std::max( a.x + a.width, b.x + b.width );
+	int bottom = std::max( a.y + a.height, b.y + b.height );
+	return CefRect( x, y, r - x, bottom - y );
+}
+
+static CefRect Intersect( const CefRect& a, const CefRect& b )
+{
+	int x = std::max( a.x, b.x );
+	int y = std::max( a.y, b.y );
+	int r = std::min( a.x + a.width, b.x + b.width );
+	int bottom = std::min( a.y + a.height, b.y + b.height );
+	if( r <= x || bottom <= y )
+		return CefRect();
+	return CefRect( x, y, r - x, bottom - y );
+}
+
+// Appends the parts of r that lie outside of hole (at most 4 rects).
+static void Subtract( const CefRect& r, const CefRect& hole,
+	std::vector< CefRect >& out )
+{
+	int top = hole.y - r.y;
+	int bottom = ( r.y + r.height ) - ( hole.y + hole.height );
+	int left = hole.x - r.x;
+	int right = ( r.x + r.width ) - ( hole.x + hole.width );
+
+	if( top > 0 )
+		out.push_back( CefRect( r.x, r.y, r.width, top ) );
+	if( bottom > 0 )
+		out.push_back( CefRect( r.x, hole.y + hole.height, r.width, bottom ) );
+	if( left > 0 )
+		out.push_back( CefRect( r.x, hole.y, left, hole.height ) );
+	if( right > 0 )
+		out.push_back( CefRect( hole.x + hole.width, hole.y, right, hole.height ) );
+}
+
+DirtyRegion::DirtyRegion() : mWidth( 0 ), mHeight( 0 )
+{}
+
+void DirtyRegion::SetBounds( int width, int height )
+{
+	mWidth = width;
+	mHeight = height;
+	Clear();
+}
+
+void DirtyRegion::Add( const CefRect& rect )
+{
+	CefRect r = Intersect( rect, CefRect( 0, 0, mWidth, mHeight ) );
+	if( r.IsEmpty() )
+		return;
+
+	mRects.push_back( r );
+}
+
+void DirtyRegion::Add( const DirtyRegion& region )
+{
+	for( auto i = region.mRects.begin(); i != region.mRects.end(); ++i )
+		Add( *i );
+}
+
+void DirtyRegion::Add( const DirtyRegion& region, const CefRect& clip )
+{
+	for( auto i = region.mRects.begin(); i != region.mRects.end(); ++i )
+		Add( Intersect( *i, clip ) );
+}
+
+void DirtyRegion::AddAll()
+{
+	mRects.clear();
+	if( mWidth > 0 && mHeight > 0 )
+		mRects.push_back( CefRect( 0, 0, mWidth, mHeight ) );
+}
+
+void DirtyRegion::Clear()
+{
+	mRects.clear();
+}
+
+bool DirtyRegion::IsEmpty() const
+{
+	return mRects.empty();
+}
+
+bool DirtyRegion::IsFull() const
+{
+	return mRects.size() == 1 && Area( mRects[0] ) == GetFullArea();
+}
+
+int DirtyRegion::GetArea() const
+{
+	int area = 0;
+	for( auto i = mRects.begin(); i != mRects.end(); ++i )
+		area += Area( *i );
+	return area;
+}
+
+int DirtyRegion::GetFullArea() const
+{
+	return mWidth * mHeight;
+}
+
+CefRect DirtyRegion::GetBounds() const
+{
+	if( mRects.empty() )
+		return CefRect();
+
+	CefRect bounds = mRects[0];
+	for( auto i = mRects.begin() + 1; i != mRects.end(); ++i )
+		bounds = Union( bounds, *i );
+	return bounds;
+}
+
+void DirtyRegion::Optimize()
+{
+	if( mRects.size() < 2 )
+		return;
+
+	if( mRects.size() > MAX_RECTS * 4 )
+	{
+		CefRect bounds = GetBounds();
+		mRects.assign( 1, bounds );
+		return;
+	}
+
+	// Merge pairs whose bounding box wastes less than an extra upload costs.
+	bool merged = true;
+	while( merged )
+	{
+		merged = false;
+		for( size_t i = 0; i < mRects.size() && !merged; ++i )
+		{
+			for( size_t j = i + 1; j < mRects.size(); ++j )
+			{
+				CefRect u = Union( mRects[i], mRects[j] );
+				int covered = Area( mRects[i] ) + Area( mRects[j] )
+					- Area( Intersect( mRects[i], mRects[j] ) );
+				if( Area( u ) - covered <= MERGE_SLACK )
+				{
+					mRects[i] = u;
+					mRects.erase( mRects.begin() + j );
+					merged = true;
+					break;
+				}
+			}
+		}
+	}
+
+	// Split what still overlaps so no pixel is uploaded twice.
+	std::vector< CefRect > disjoint;
+	for( auto i = mRects.begin(); i != mRects.end(); ++i )
+	{
+		std::vector< CefRect > pieces( 1, *i );
+		for( auto d = disjoint.begin(); d != disjoint.end(); ++d )
+		{
+			std::vector< CefRect > rest;
+			for( auto p = pieces.begin(); p != pieces.end(); ++p )
+			{
+				CefRect overlap = Intersect( *p, *d );
+				if( overlap.IsEmpty() )
+					rest.push_back( *p );
+				else
+					Subtract( *p, overlap, rest );
+			}
+			pieces.swap( rest );
+		}
+		disjoint.insert( disjoint.end(), pieces.begin(), pieces.end() );
+	}
+	mRects.swap( disjoint );
+
+	if( mRects.size() > MAX_RECTS )
+	{
+		CefRect bounds = GetBounds();
+		mRects.assign( 1, bounds );
+	}
+}
+
+} // namespace avg
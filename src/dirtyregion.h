@@ -0,0 +1,50 @@
+#ifndef DIRTYREGION_H
+#define DIRTYREGION_H
+
+#include <vector>
+
+#include <include/internal/cef_types_wrappers.h>
+
+namespace avg
+{
+
+/*! \brief List of rectangles of a frame that changed since the last upload.
+ * Rects are clipped to the frame bounds. Optimize() merges rects whose
+ * bounding box wastes little and splits overlapping rects, so that every
+ * changed pixel is transferred exactly once. */
+class DirtyRegion
+{
+public:
+	DirtyRegion();
+
+	void SetBounds( int width, int height );
+
+	void Add( const CefRect& rect );
+	void Add( const DirtyRegion& region );
+	/*! \brief Adds the parts of region that lie inside clip. */
+	void Add( const DirtyRegion& region, const CefRect& clip );
+	void AddAll();
+	void Clear();
+
+	bool IsEmpty() const;
+	bool IsFull() const;
+
+	/*! \brief Sum of the areas of all rects in pixels.
+	 * Only free of overlap after Optimize(). */
+	int GetArea() const;
+	int GetFullArea() const;
+	CefRect GetBounds() const;
+
+	void Optimize();
+
+	const std::vector< CefRect >& GetRects() const { return mRects; }
+
+private:
+	int mWidth;
+	int mHeight;
+	std::vector< CefRect > mRects;
+};
+
+} // namespace avg
+
+#endif
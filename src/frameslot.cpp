@@ -0,0 +1,74 @@
+#include "frameslot.h"
+
+#include "copypool.h"
+
+namespace avg
+{
+
+// Older paints are merged once more are waiting for the consumer.
+static const size_t MAX_HISTORY = 8;
+
+FrameSlot::FrameSlot() : mMiddle( 1 ), mConsumedSeq( 0 ), mFront( 0 ),
+	mBack( 2 ), mSeq( 0 )
+{}
+
+void FrameSlot::Write( const unsigned char* src, int width, int height,
+	const DirtyRegion& painted, long long time )
+{
+	++mSeq;
+	for( int i = 0; i < 3; ++i )
+		mStale[i].Add( painted );
+
+	// A buffer of another size is refreshed as a whole.
+	Frame& frame = mFrames[mBack];
+	DirtyRegion& stale = mStale[mBack];
+	if( frame.mWidth != width || frame.mHeight != height )
+	{
+		frame.mPixels.resize( width * height * 4 );
+		frame.mWidth = width;
+		frame.mHeight = height;
+		stale.SetBounds( width, height );
+		stale.AddAll();
+	}
+	stale.Optimize();
+
+	CopyPool::Fence fence;
+	CopyPool::Get().CopyRegion( src, width * 4, frame.mPixels.data(),
+		width * 4, stale, fence );
+	CopyPool::Get().Wait( fence );
+	stale.Clear();
+
+	// Whatever the consumer may not have seen yet.
+	unsigned consumed = mConsumedSeq;
+	while( !mHistory.empty() && mHistory.front().first <= consumed )
+		mHistory.pop_front();
+	mHistory.push_back( std::make_pair( mSeq, painted ) );
+	if( mHistory.size() > MAX_HISTORY )
+	{
+		// Merging into the later entry keeps it until both are consumed.
+		mHistory[1].second.Add( mHistory[0].second );
+		mHistory[1].second.Optimize();
+		mHistory.pop_front();
+	}
+
+	frame.mDirty.SetBounds( width, height );
+	for( auto i = mHistory.begin(); i != mHistory.end(); ++i )
+		frame.mDirty.Add( i->second );
+	frame.mDirty.Optimize();
+	frame.mSeq = mSeq;
+	frame.mTime = time;
+
+	mBack = mMiddle.exchange( mBack | FRESH ) & INDEX_MASK;
+}
+
+const FrameSlot::Frame* FrameSlot::Read()
+{
+	if( !( mMiddle & FRESH ) )
+		return nullptr;
+
+	mFront = mMiddle.exchange( mFront ) & INDEX_MASK;
+	mConsumedSeq = mFrames[mFront].mSeq;
+	return &mFrames[mFront];
+}
+
+} // namespace avg
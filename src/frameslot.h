@@ -0,0 +1,72 @@
+#ifndef FRAMESLOT_H
+#define FRAMESLOT_H
+
+#include <atomic>
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include "dirtyregion.h"
+
+namespace avg
+{
+
+/*! \brief Triple-buffered handoff of paints from CEF's UI thread to the
+ * main thread, without locks. The producer always has a buffer to write
+ * to and the consumer always gets the newest complete frame.
+ *
+ * Buffers are only partially rewritten, so each one tracks what changed
+ * since it was last written. The dirty region handed to the consumer
+ * covers everything painted since the last frame the producer knows was
+ * consumed, so skipped frames don't lose changes. */
+class FrameSlot
+{
+public:
+	struct Frame
+	{
+		Frame() : mWidth( 0 ), mHeight( 0 ), mSeq( 0 ), mTime( 0 ) {}
+
+		std::vector< unsigned char > mPixels;
+		int mWidth;
+		int mHeight;
+		// Changed since the consumer's last frame, may be more.
+		DirtyRegion mDirty;
+		unsigned mSeq;
+		// When the newest paint in it was written.
+		long long mTime;
+	};
+
+	FrameSlot();
+
+	/*! \brief Producer side. src is a full frame of width * height pixels,
+	 * painted the parts that changed. time is passed on to the consumer. */
+	void Write( const unsigned char* src, int width, int height,
+		const DirtyRegion& painted, long long time = 0 );
+
+	/*! \brief Consumer side. Returns the newest unread frame or nullptr.
+	 * Valid until the next call. */
+	const Frame* Read();
+
+private:
+	static const int FRESH = 4;
+	static const int INDEX_MASK = 3;
+
+	Frame mFrames[3];
+	// Index of the buffer between producer and consumer, FRESH if unread.
+	std::atomic< int > mMiddle;
+	std::atomic< unsigned > mConsumedSeq;
+
+	// Consumer only.
+	int mFront;
+
+	// Producer only.
+	int mBack;
+	unsigned mSeq;
+	DirtyRegion mStale[3];
+	// Paints not known to be consumed yet.
+	std::deque< std::pair< unsigned, DirtyRegion > > mHistory;
+};
+
+} // namespace avg
+
+#endif
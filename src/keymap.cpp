@@ -0,0 +1,173 @@
+#include "keymap.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace avg
+{
+
+struct NamedKey
+{
+	const char* mName;
+	int mCode;
+};
+
+// Sorted by name in byte order for the binary search.
+static const NamedKey KEY_CODES[] =
+{
+	{ "Backspace", 8 },
+	{ "CapsLock", 20 },
+	{ "Comma", 190 },
+	{ "Delete", 46 },
+	{ "Divide", 111 },
+	{ "Down", 40 },
+	{ "End", 35 },
+	{ "Escape", 27 },
+	{ "F1", 112 },
+	{ "F10", 121 },
+	{ "F11", 122 },
+	{ "F12", 123 },
+	{ "F13", 124 },
+	{ "F14", 125 },
+	{ "F15", 126 },
+	{ "F16", 127 },
+	{ "F17", 128 },
+	{ "F18", 129 },
+	{ "F19", 130 },
+	{ "F2", 113 },
+	{ "F20", 131 },
+	{ "F21", 132 },
+	{ "F22", 133 },
+	{ "F23", 134 },
+	{ "F24", 135 },
+	{ "F3", 114 },
+	{ "F4", 115 },
+	{ "F5", 116 },
+	{ "F6", 117 },
+	{ "F7", 118 },
+	{ "F8", 119 },
+	{ "F9", 120 },
+	{ "Home", 36 },
+	{ "Insert", 45 },
+	{ "Keypad *", 106 },
+	{ "Keypad +", 107 },
+	{ "Keypad -", 109 },
+	{ "Keypad .", 190 },
+	{ "Keypad /", 111 },
+	{ "Keypad 0", 96 },
+	{ "Keypad 1", 97 },
+	{ "Keypad 2", 98 },
+	{ "Keypad 3", 99 },
+	{ "Keypad 4", 100 },
+	{ "Keypad 5", 101 },
+	{ "Keypad 6", 102 },
+	{ "Keypad 7", 103 },
+	{ "Keypad 8", 104 },
+	{ "Keypad 9", 105 },
+	{ "Keypad Enter", 13 },
+	{ "Left", 37 },
+	{ "Left Alt", 18 },
+	{ "Left Ctrl", 17 },
+	{ "Left GUI", 91 },
+	{ "Left Shift", 16 },
+	{ "Menu", 93 },
+	{ "Minus", 109 },
+	{ "Multiply", 106 },
+	{ "Numlock", 144 },
+	{ "PageDown", 34 },
+	{ "PageUp", 33 },
+	{ "Pause", 19 },
+	{ "Period", 190 },
+	{ "Plus", 107 },
+	{ "PrintScreen", 44 },
+	{ "Return", 13 },
+	{ "Right", 39 },
+	{ "Right Alt", 18 },
+	{ "Right Ctrl", 17 },
+	{ "Right GUI", 92 },
+	{ "Right Shift", 16 },
+	{ "ScrollLock", 141 },
+	{ "Space", 32 },
+	{ "Tab", 9 },
+	{ "Up", 38 },
+};
+
+static const size_t KEY_CODE_COUNT = sizeof( KEY_CODES ) / sizeof( KEY_CODES[0] );
+
+static bool IsContinuation( unsigned char c )
+{
+	return ( c & 0xc0 ) == 0x80;
+}
+
+int KeyMap::GetKeyCode( const std::string& name )
+{
+	// Printable keys have one character names, none of them is listed.
+	if( name.size() < 2 )
+		return 0;
+
+	const char* key = name.c_str();
+	const NamedKey* end = KEY_CODES + KEY_CODE_COUNT;
+	const NamedKey* i = std::lower_bound( KEY_CODES, end, key,
+		[]( const NamedKey& entry, const char* k )
+		{
+			return std::strcmp( entry.mName, k ) < 0;
+		} );
+	if( i == end || std::strcmp( i->mName, key ) != 0 )
+		return 0;
+	return i->mCode;
+}
+
+char16_t KeyMap::FirstUTF16( const std::string& text )
+{
+	const unsigned char* s = (const unsigned char*)text.data();
+	size_t size = text.size();
+	if( size == 0 )
+		return 0;
+
+	unsigned lead = s[0];
+	if( lead < 0x80 )
+		return (char16_t)lead;
+
+	size_t length;
+	unsigned cp;
+	if( ( lead & 0xe0 ) == 0xc0 )
+	{
+		length = 2;
+		cp = lead & 0x1f;
+	}
+	else if( ( lead & 0xf0 ) == 0xe0 )
+	{
+		length = 3;
+		cp = lead & 0x0f;
+	}
+	else if( ( lead & 0xf8 ) == 0xf0 )
+	{
+		length = 4;
+		cp = lead & 0x07;
+	}
+	else
+	{
+		return 0;
+	}
+
+	if( size < length )
+		return 0;
+	for( size_t i = 1; i < length; ++i )
+	{
+		if( !IsContinuation( s[i] ) )
+			return 0;
+		cp = ( cp << 6 ) | ( s[i] & 0x3f );
+	}
+
+	// Overlong forms, surrogates and values beyond Unicode are malformed.
+	static const unsigned MIN_CODE_POINT[] = { 0, 0, 0x80, 0x800, 0x10000 };
+	if( cp < MIN_CODE_POINT[length] || cp > 0x10ffff ||
+		( cp >= 0xd800 && cp <= 0xdfff ) )
+		return 0;
+
+	if( cp > 0xffff )
+		return (char16_t)( 0xd800 + ( ( cp - 0x10000 ) >> 10 ) );
+	return (char16_t)cp;
+}
+
+} // namespace avg
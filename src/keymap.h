@@ -0,0 +1,26 @@
+#ifndef KEYMAP_H
+#define KEYMAP_H
+
+#include <cstddef>
+#include <string>
+
+namespace avg
+{
+
+/*! \brief Translates libavg key events for CEF without allocating.
+ * Key names are looked up in a table sorted at compile time. */
+class KeyMap
+{
+public:
+	/*! \brief Windows virtual key code for a libavg key name, which CEF
+	 * expects on every platform. 0 if the name isn't a special key. */
+	static int GetKeyCode( const std::string& name );
+
+	/*! \brief First UTF-16 code unit of UTF-8 text. Code points beyond the
+	 * BMP give their high surrogate. 0 if text is empty or malformed. */
+	static char16_t FirstUTF16( const std::string& text );
+};
+
+} // namespace avg
+
+#endif
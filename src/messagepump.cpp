@@ -0,0 +1,98 @@
+#include "messagepump.h"
+
+#include <algorithm>
+#include <limits>
+
+#include <include/cef_app.h>
+
+#include <player/Player.h>
+
+namespace avg
+{
+
+// CEF recommends pumping at least this often even if it didn't ask, in
+// case a schedule request got lost.
+static const std::chrono::milliseconds MAX_PUMP_DELAY( 33 );
+
+static const long long NOT_DUE = std::numeric_limits< long long >::max();
+
+MessagePump::MessagePump()
+	: mBudget( std::chrono::milliseconds( 4 ) ), mPumping( true ),
+	mDispatchBudget( std::chrono::milliseconds( 2 ) ), mDueTime( 0 ),
+	mLastPump( Clock::now() )
+{}
+
+MessagePump& MessagePump::Get()
+{
+	static MessagePump pump;
+	return pump;
+}
+
+void MessagePump::AddClient( IPreRenderListener* client )
+{
+	if( mClients.empty() )
+		Player::get()->registerPreRenderListener( this );
+	mClients.push_back( client );
+}
+
+void MessagePump::RemoveClient( IPreRenderListener* client )
+{
+	auto i = std::find( mClients.begin(), mClients.end(), client );
+	if( i == mClients.end() )
+		return;
+
+	mClients.erase( i );
+	if( mClients.empty() )
+		Player::get()->unregisterPreRenderListener( this );
+}
+
+void MessagePump::ScheduleWork( long long delayms )
+{
+	Clock::time_point due = Clock::now() +
+		std::chrono::milliseconds( std::max( delayms, 0LL ) );
+	long long ticks = due.time_since_epoch().count();
+
+	// Keep the earliest request.
+	long long current = mDueTime;
+	while( ticks < current && !mDueTime.compare_exchange_weak( current, ticks ) )
+	{}
+}
+
+bool MessagePump::IsDue( Clock::time_point now ) const
+{
+	return mDueTime <= now.time_since_epoch().count() ||
+		now - mLastPump >= MAX_PUMP_DELAY;
+}
+
+void MessagePump::Pump( Clock::time_point now )
+{
+	// Cleared before the work, CEF schedules again from inside it.
+	mDueTime = NOT_DUE;
+	mLastPump = now;
+	CefDoMessageLoopWork();
+}
+
+void MessagePump::onPreRender()
+{
+	mDispatchDeadline = Clock::now() + mDispatchBudget;
+
+	// Clients may remove themselves.
+	std::vector< IPreRenderListener* > clients = mClients;
+	for( auto i = clients.begin(); i != clients.end(); ++i )
+		(*i)->onPreRender();
+
+	if( !mPumping )
+		return;
+
+	Clock::time_point start = Clock::now();
+	Clock::time_point now = start;
+	while( IsDue( now ) )
+	{
+		Pump( now );
+		now = Clock::now();
+		if( now - start >= mBudget )
+			break;
+	}
+}
+
+} // namespace avg
@@ -0,0 +1,70 @@
+#ifndef MESSAGEPUMP_H
+#define MESSAGEPUMP_H
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include <base/IPreRenderListener.h>
+
+namespace avg
+{
+
+/*! \brief Drives the CEF message loop for all nodes of the process.
+ * Registered once as pre-render listener while it has clients. Every
+ * frame it first runs the clients' onPreRender, then pumps CEF, but only
+ * when CEF scheduled work through OnScheduleMessagePumpWork and only
+ * for as long as the per-frame budget allows. Needs external_message_pump.
+ * It also sets the deadline the clients dispatch Python callbacks until. */
+class MessagePump : public IPreRenderListener
+{
+public:
+	static MessagePump& Get();
+
+	void AddClient( IPreRenderListener* client );
+	void RemoveClient( IPreRenderListener* client );
+
+	/*! \brief Maximum time spent in CefDoMessageLoopWork per frame.
+	 * At least one pass runs if work is due, even if it takes longer. */
+	void SetBudget( int ms ){ mBudget = std::chrono::milliseconds( ms ); }
+
+	/*! \brief Time per frame all clients together may spend in queued
+	 * Python callbacks, counted from the start of the frame. */
+	void SetDispatchBudget( int ms ){ mDispatchBudget = std::chrono::milliseconds( ms ); }
+
+	/*! \brief Whether this frame's dispatch budget is left. */
+	bool InDispatchBudget() const { return Clock::now() < mDispatchDeadline; }
+
+	/*! \brief Turns pumping off while CEF runs its own message loop thread.
+	 * Clients are still called every frame. */
+	void SetPumping( bool pumping ){ mPumping = pumping; }
+
+	/*! \brief Requests a pump in delayms, <= 0 for as soon as possible.
+	 * Thread-safe, called from CEF on any thread. */
+	void ScheduleWork( long long delayms );
+
+	// IPreRenderListener
+	void onPreRender();
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	MessagePump();
+
+	bool IsDue( Clock::time_point now ) const;
+	void Pump( Clock::time_point now );
+
+	std::vector< IPreRenderListener* > mClients;
+	Clock::duration mBudget;
+	bool mPumping;
+	Clock::duration mDispatchBudget;
+	Clock::time_point mDispatchDeadline;
+
+	// When the next pump is due, as Clock ticks since epoch.
+	std::atomic< long long > mDueTime;
+	Clock::time_point mLastPump;
+};
+
+} // namespace avg
+
+#endif
@@ -0,0 +1,75 @@
+#include "nodestats.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace avg
+{
+
+NodeStats::NodeStats()
+{
+	Reset( 0 );
+}
+
+void NodeStats::Reset( long long now )
+{
+	mResetTime = now;
+	mPaints = 0;
+	mDirtyPixels = 0;
+	mCopiedBytes = 0;
+	mUploadedBytes = 0;
+	mMessages = 0;
+	mDispatched = 0;
+	mLatencies.Clear();
+	mDispatchLatencies.Clear();
+}
+
+void NodeStats::AddPaint( long long dirtypixels, long long copiedbytes )
+{
+	++mPaints;
+	mDirtyPixels += dirtypixels;
+	mCopiedBytes += copiedbytes;
+}
+
+double NodeStats::GetSeconds( long long now ) const
+{
+	return ( now - mResetTime ) / 1000000.0;
+}
+
+double NodeStats::GetMessageRate( long long now ) const
+{
+	double seconds = GetSeconds( now );
+	return seconds > 0.0 ? mMessages / seconds : 0.0;
+}
+
+void NodeStats::Samples::Clear()
+{
+	mValues.clear();
+	mNext = 0;
+}
+
+void NodeStats::Samples::Add( long long us )
+{
+	if( (int)mValues.size() < LATENCY_SAMPLES )
+	{
+		mValues.push_back( us );
+		return;
+	}
+	mValues[mNext] = us;
+	mNext = ( mNext + 1 ) % LATENCY_SAMPLES;
+}
+
+double NodeStats::Samples::Percentile( double p ) const
+{
+	if( mValues.empty() )
+		return 0.0;
+
+	// Nearest rank. Only runs when stats are read, so a copy is fine.
+	std::vector< long long > sorted( mValues );
+	size_t rank = (size_t)std::ceil( p * sorted.size() );
+	size_t index = std::min( std::max( rank, (size_t)1 ), sorted.size() ) - 1;
+	std::nth_element( sorted.begin(), sorted.begin() + index, sorted.end() );
+	return sorted[index] / 1000.0;
+}
+
+} // namespace avg
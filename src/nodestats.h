@@ -0,0 +1,74 @@
+#ifndef NODESTATS_H
+#define NODESTATS_H
+
+#include <vector>
+
+namespace avg
+{
+
+/*! \brief Performance counters of one browser since the last Reset().
+ * Paint-to-upload and callback dispatch latencies are kept for the last
+ * LATENCY_SAMPLES of each, percentiles are computed from those. Main
+ * thread only. */
+class NodeStats
+{
+public:
+	static const int LATENCY_SAMPLES = 512;
+
+	NodeStats();
+
+	/*! \brief Zeroes all counters. now is in microseconds. */
+	void Reset( long long now );
+
+	void AddPaint( long long dirtypixels, long long copiedbytes );
+	void AddUpload( long long bytes ){ mUploadedBytes += bytes; }
+	void AddMessage(){ ++mMessages; }
+	void AddLatency( long long us ){ mLatencies.Add( us ); }
+	/*! \brief A queued callback ran us after it was queued. */
+	void AddDispatch( long long us ){ ++mDispatched; mDispatchLatencies.Add( us ); }
+
+	long long GetPaints() const { return mPaints; }
+	long long GetDirtyPixels() const { return mDirtyPixels; }
+	long long GetCopiedBytes() const { return mCopiedBytes; }
+	long long GetUploadedBytes() const { return mUploadedBytes; }
+	long long GetMessages() const { return mMessages; }
+	long long GetDispatched() const { return mDispatched; }
+
+	/*! \brief Seconds since the last reset. */
+	double GetSeconds( long long now ) const;
+	double GetMessageRate( long long now ) const;
+	/*! \brief Latency in ms that fraction p of the samples don't exceed,
+	 * 0 without samples. */
+	double GetLatencyPercentile( double p ) const { return mLatencies.Percentile( p ); }
+	double GetDispatchLatencyPercentile( double p ) const
+		{ return mDispatchLatencies.Percentile( p ); }
+
+private:
+	// Ring of the newest samples in us.
+	class Samples
+	{
+	public:
+		void Clear();
+		void Add( long long us );
+		double Percentile( double p ) const;
+
+	private:
+		std::vector< long long > mValues;
+		int mNext;
+	};
+
+	long long mResetTime;
+	long long mPaints;
+	long long mDirtyPixels;
+	long long mCopiedBytes;
+	long long mUploadedBytes;
+	long long mMessages;
+	long long mDispatched;
+
+	Samples mLatencies;
+	Samples mDispatchLatencies;
+};
+
+} // namespace avg
+
+#endif
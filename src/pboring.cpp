@@ -0,0 +1,296 @@
+#include "pboring.h"
+
+#include <iostream>
+
+#include <SDL2/SDL_video.h>
+
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#endif
+#ifndef GL_SYNC_GPU_COMMANDS_COMPLETE
+#define GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#endif
+#ifndef GL_SYNC_FLUSH_COMMANDS_BIT
+#define GL_SYNC_FLUSH_COMMANDS_BIT 0x00000001
+#endif
+#ifndef GL_TIMEOUT_EXPIRED
+#define GL_TIMEOUT_EXPIRED 0x911B
+#endif
+#ifndef GL_WAIT_FAILED
+#define GL_WAIT_FAILED 0x911D
+#endif
+
+namespace avg
+{
+
+// Entry points not covered by libavg's glproc.
+// Loaded once in IsSupported().
+typedef void (APIENTRY *PFNBUFFERSTORAGE)( GLenum target, GLsizeiptr size,
+	const void* data, GLbitfield flags );
+typedef void* (APIENTRY *PFNMAPBUFFERRANGE)( GLenum target, GLintptr offset,
+	GLsizeiptr length, GLbitfield access );
+typedef GLboolean (APIENTRY *PFNUNMAPBUFFER)( GLenum target );
+typedef void (APIENTRY *PFNBINDBUFFER)( GLenum target, GLuint buffer );
+typedef void (APIENTRY *PFNGENBUFFERS)( GLsizei n, GLuint* buffers );
+typedef void (APIENTRY *PFNDELETEBUFFERS)( GLsizei n, const GLuint* buffers );
+typedef GLsync (APIENTRY *PFNFENCESYNC)( GLenum condition, GLbitfield flags );
+typedef GLenum (APIENTRY *PFNCLIENTWAITSYNC)( GLsync sync, GLbitfield flags,
+	GLuint64 timeout );
+typedef void (APIENTRY *PFNDELETESYNC)( GLsync sync );
+
+static PFNBUFFERSTORAGE BufferStorage;
+static PFNMAPBUFFERRANGE MapBufferRange;
+static PFNUNMAPBUFFER UnmapBuffer;
+static PFNBINDBUFFER BindBuffer;
+static PFNGENBUFFERS GenBuffers;
+static PFNDELETEBUFFERS DeleteBuffers;
+static PFNFENCESYNC FenceSync;
+static PFNCLIENTWAITSYNC ClientWaitSync;
+static PFNDELETESYNC DeleteSync;
+
+// Time to wait for the oldest upload when all buffers are in flight.
+static const GLuint64 FENCE_TIMEOUT_NS = 100 * 1000 * 1000;
+
+PBORing::PBORing()
+	: mSize( 0, 0 ), mStride( 0 ), mBuffer( 0 ), mMapped( nullptr ),
+	mWriting( nullptr )
+{}
+
+PBORing::~PBORing()
+{
+	// The last reference may go away on a thread without GL context, so
+	// the owner has to Deinit() on the main thread before.
+	if( mBuffer )
+	{
+		std::cerr << "Warning: Pixel buffer ring destroyed without Deinit(), "
+			"leaking its buffers." << std::endl;
+	}
+	for( auto i = mSlots.begin(); i != mSlots.end(); ++i )
+		delete *i;
+}
+
+bool PBORing::IsSupported()
+{
+	static int supported = -1;
+	if( supported != -1 )
+		return supported == 1;
+
+	supported = 0;
+	if( GLContext::getCurrent()->isGLES() ||
+		!queryOGLExtension( "GL_ARB_buffer_storage" ) ||
+		!queryOGLExtension( "GL_ARB_sync" ) )
+	{
+		return false;
+	}
+
+	BufferStorage = (PFNBUFFERSTORAGE)SDL_GL_GetProcAddress( "glBufferStorage" );
+	MapBufferRange = (PFNMAPBUFFERRANGE)SDL_GL_GetProcAddress( "glMapBufferRange" );
+	UnmapBuffer = (PFNUNMAPBUFFER)SDL_GL_GetProcAddress( "glUnmapBuffer" );
+	BindBuffer = (PFNBINDBUFFER)SDL_GL_GetProcAddress( "glBindBuffer" );
+	GenBuffers = (PFNGENBUFFERS)SDL_GL_GetProcAddress( "glGenBuffers" );
+	DeleteBuffers = (PFNDELETEBUFFERS)SDL_GL_GetProcAddress( "glDeleteBuffers" );
+	FenceSync = (PFNFENCESYNC)SDL_GL_GetProcAddress( "glFenceSync" );
+	ClientWaitSync = (PFNCLIENTWAITSYNC)SDL_GL_GetProcAddress( "glClientWaitSync" );
+	DeleteSync = (PFNDELETESYNC)SDL_GL_GetProcAddress( "glDeleteSync" );
+
+	if( BufferStorage && MapBufferRange && UnmapBuffer && BindBuffer &&
+		GenBuffers && DeleteBuffers && FenceSync && ClientWaitSync && DeleteSync )
+	{
+		supported = 1;
+	}
+	return supported == 1;
+}
+
+bool PBORing::Init( glm::uvec2 size, int count )
+{
+	Deinit();
+	if( !IsSupported() || size.x == 0 || size.y == 0 || count < 1 )
+		return false;
+
+	mSize = size;
+	mStride = size.x * 4;
+	GLsizeiptr slotsize = (GLsizeiptr)mStride * size.y;
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT |
+		GL_MAP_COHERENT_BIT;
+
+	GenBuffers( 1, &mBuffer );
+	BindBuffer( GL_PIXEL_UNPACK_BUFFER, mBuffer );
+	BufferStorage( GL_PIXEL_UNPACK_BUFFER, slotsize * count, nullptr, flags );
+	mMapped = (unsigned char*)MapBufferRange( GL_PIXEL_UNPACK_BUFFER, 0,
+		slotsize * count, flags );
+	BindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+
+	if( !mMapped )
+	{
+		std::cerr << "Warning: Couldn't map pixel buffer, "
+			"falling back to bitmap upload." << std::endl;
+		Deinit();
+		return false;
+	}
+
+	for( int i = 0; i < count; ++i )
+	{
+		Slot* slot = new Slot;
+		slot->mState = FREE;
+		slot->mFence = nullptr;
+		slot->mOffset = slotsize * i;
+		slot->mRegion.SetBounds( size.x, size.y );
+		mSlots.push_back( slot );
+	}
+	return true;
+}
+
+void PBORing::Deinit()
+{
+	for( auto i = mSlots.begin(); i != mSlots.end(); ++i )
+	{
+		if( (*i)->mFence )
+			DeleteSync( (*i)->mFence );
+		delete *i;
+	}
+	mSlots.clear();
+	mWriting = nullptr;
+
+	if( mBuffer )
+	{
+		BindBuffer( GL_PIXEL_UNPACK_BUFFER, mBuffer );
+		UnmapBuffer( GL_PIXEL_UNPACK_BUFFER );
+		BindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+		DeleteBuffers( 1, &mBuffer );
+	}
+	mBuffer = 0;
+	mMapped = nullptr;
+	mSize = glm::uvec2( 0, 0 );
+}
+
+bool PBORing::IsInitialized() const
+{
+	return mMapped != nullptr;
+}
+
+unsigned char* PBORing::BeginWrite( int width, int height )
+{
+	if( !mMapped || (unsigned)width > mSize.x || (unsigned)height > mSize.y )
+		return nullptr;
+
+	// Append to the pending buffer if it wasn't picked up yet,
+	// otherwise start a new one.
+	Slot* target = nullptr;
+	for( auto i = mSlots.begin(); i != mSlots.end() && !target; ++i )
+	{
+		int expected = READY;
+		if( (*i)->mState.compare_exchange_strong( expected, WRITING ) )
+			target = *i;
+	}
+	for( auto i = mSlots.begin(); i != mSlots.end() && !target; ++i )
+	{
+		int expected = FREE;
+		if( (*i)->mState.compare_exchange_strong( expected, WRITING ) )
+		{
+			target = *i;
+			target->mRegion.Clear();
+		}
+	}
+	if( !target )
+		return nullptr;
+
+	mWriting = target;
+	return mMapped + target->mOffset;
+}
+
+void PBORing::EndWrite( const DirtyRegion& region )
+{
+	mWriting->mRegion.Add( region );
+	mWriting->mState = READY;
+	mWriting = nullptr;
+}
+
+int PBORing::Upload( GLContext* context, MCTexturePtr texture )
+{
+	Reclaim( false );
+
+	Slot* pending = nullptr;
+	for( auto i = mSlots.begin(); i != mSlots.end() && !pending; ++i )
+	{
+		int expected = READY;
+		if( (*i)->mState.compare_exchange_strong( expected, INFLIGHT ) )
+			pending = *i;
+	}
+	if( !pending )
+		return 0;
+
+	pending->mRegion.Optimize();
+	const std::vector< CefRect >& rects = pending->mRegion.GetRects();
+
+	context->bindTexture( GL_TEXTURE0, texture->getID( context ) );
+	BindBuffer( GL_PIXEL_UNPACK_BUFFER, mBuffer );
+	glPixelStorei( GL_UNPACK_ROW_LENGTH, mSize.x );
+	for( auto r = rects.begin(); r != rects.end(); ++r )
+	{
+		// With a bound unpack buffer the pointer is an offset into it.
+		size_t offset = pending->mOffset + r->y * mStride + r->x * 4;
+		glTexSubImage2D( GL_TEXTURE_2D, 0, r->x, r->y, r->width, r->height,
+			TexInfo::getGLFormat( B8G8R8A8 ), TexInfo::getGLType( B8G8R8A8 ),
+			(const void*)offset );
+	}
+	glPixelStorei( GL_UNPACK_ROW_LENGTH, 0 );
+	BindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+	GLContext::checkError( "PBORing::Upload" );
+
+	pending->mFence = FenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+	int bytes = pending->mRegion.GetArea() * 4;
+
+	// Keep a buffer free for the next paint, even if that means waiting.
+	Reclaim( true );
+
+	return bytes;
+}
+
+void PBORing::Reclaim( bool wait )
+{
+	Slot* oldest = nullptr;
+	bool havefree = false;
+	for( auto i = mSlots.begin(); i != mSlots.end(); ++i )
+	{
+		Slot* slot = *i;
+		if( slot->mState != INFLIGHT )
+		{
+			havefree |= slot->mState == FREE;
+			continue;
+		}
+
+		GLenum result = ClientWaitSync( slot->mFence, 0, 0 );
+		if( result == GL_TIMEOUT_EXPIRED )
+		{
+			oldest = slot;
+			continue;
+		}
+		DeleteSync( slot->mFence );
+		slot->mFence = nullptr;
+		slot->mState = FREE;
+		havefree = true;
+	}
+
+	if( wait && !havefree && oldest )
+	{
+		GLenum result = ClientWaitSync( oldest->mFence,
+			GL_SYNC_FLUSH_COMMANDS_BIT, FENCE_TIMEOUT_NS );
+		if( result == GL_TIMEOUT_EXPIRED || result == GL_WAIT_FAILED )
+		{
+			std::cerr << "Warning: Pixel buffer upload didn't finish in time."
+				<< std::endl;
+			return;
+		}
+		DeleteSync( oldest->mFence );
+		oldest->mFence = nullptr;
+		oldest->mState = FREE;
+	}
+}
+
+} // namespace avg
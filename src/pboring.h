@@ -0,0 +1,78 @@
+#ifndef PBORING_H
+#define PBORING_H
+
+#include <atomic>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <graphics/GLContext.h>
+#include <graphics/MCTexture.h>
+#include <graphics/OGLHelper.h>
+
+#include "dirtyregion.h"
+
+namespace avg
+{
+
+/*! \brief Ring of persistently mapped pixel buffer objects.
+ * Frames from OnPaint are copied straight into mapped buffer memory and the
+ * texture is updated from there, so the driver can DMA the pixels instead
+ * of copying them out of a Bitmap. Needs GL_ARB_buffer_storage.
+ *
+ * BeginWrite()/EndWrite() may be called from the thread receiving paints,
+ * everything else must be called with a current GL context. At most one
+ * buffer is pending at a time; paints arriving before its upload are merged
+ * into it. */
+class PBORing
+{
+public:
+	PBORing();
+	~PBORing();
+
+	/*! \brief Checks for persistent mapping and loads the entry points. */
+	static bool IsSupported();
+
+	bool Init( glm::uvec2 size, int count );
+	/*! \brief Frees the buffers. Needs a current GL context and must
+	 * happen before destruction if Init() succeeded. */
+	void Deinit();
+	bool IsInitialized() const;
+	glm::uvec2 GetSize() const { return mSize; }
+
+	/*! \brief Returns mapped memory to copy a frame of the given size into.
+	 * Returns nullptr if the frame is too big or no buffer is free. The
+	 * caller then has to take another path. */
+	unsigned char* BeginWrite( int width, int height );
+	/*! \brief Marks the rects of region as written and the buffer as ready. */
+	void EndWrite( const DirtyRegion& region );
+	int GetStride() const { return mStride; }
+
+	/*! \brief Updates texture from the pending buffer and fences it.
+	 * \return Bytes uploaded, 0 if nothing was pending. */
+	int Upload( GLContext* context, MCTexturePtr texture );
+
+private:
+	enum SlotState { FREE, WRITING, READY, INFLIGHT };
+
+	struct Slot
+	{
+		std::atomic< int > mState;
+		GLsync mFence;
+		size_t mOffset;
+		DirtyRegion mRegion;
+	};
+
+	void Reclaim( bool wait );
+
+	glm::uvec2 mSize;
+	int mStride;
+	GLuint mBuffer;
+	unsigned char* mMapped;
+	std::vector< Slot* > mSlots;
+	Slot* mWriting;
+};
+
+} // namespace avg
+
+#endif
@@ -0,0 +1,551 @@
+#include "pixelkernels.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PIXELKERNELS_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_SSE2
+#define TARGET_AVX2
+#else
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace avg
+{
+
+// All versions use the same float operations for unpremultiplying and the
+// same integer operations for premultiplying, so their results are
+// identical to the bit.
+
+// Hash: every 16 bytes are split into two 64 bit lanes, xored with a key
+// that depends on their position and multiplied lo32 * hi32. Lane j adds
+// that product and the other lane's data (the XXH3 accumulate step).
+// Everything is a sum, so the order chunks are added in doesn't matter.
+typedef unsigned long long uint64;
+static const uint64 HASH_KEY[2] = { 0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL };
+static const uint64 HASH_STEP[2] = { 0x9e3779b185ebca87ULL, 0xc2b2ae3d27d4eb4fULL };
+
+///****************************************************************
+// Scalar
+
+static void PremultiplyScalar( const unsigned char* src, unsigned char* dst,
+	int count )
+{
+	for( int i = 0; i < count; ++i, src += 4, dst += 4 )
+	{
+		unsigned a = src[3];
+		for( int c = 0; c < 3; ++c )
+		{
+			// Rounded division by 255.
+			unsigned t = src[c] * a + 128;
+			dst[c] = (unsigned char)( ( t + ( t >> 8 ) ) >> 8 );
+		}
+		dst[3] = (unsigned char)a;
+	}
+}
+
+static void UnpremultiplyScalar( const unsigned char* src, unsigned char* dst,
+	int count )
+{
+	for( int i = 0; i < count; ++i, src += 4, dst += 4 )
+	{
+		unsigned a = src[3];
+		if( a == 255 )
+		{
+			memmove( dst, src, 4 );
+			continue;
+		}
+
+		float scale = 255.0f / (float)( a ? a : 1 );
+		for( int c = 0; c < 3; ++c )
+		{
+			int v = (int)( src[c] * scale + 0.5f );
+			dst[c] = (unsigned char)( v > 255 ? 255 : v );
+		}
+		dst[3] = (unsigned char)a;
+	}
+}
+
+static void SwizzleRBScalar( const unsigned char* src, unsigned char* dst,
+	int count )
+{
+	for( int i = 0; i < count; ++i, src += 4, dst += 4 )
+	{
+		unsigned char b = src[0];
+		unsigned char r = src[2];
+		dst[0] = r;
+		dst[1] = src[1];
+		dst[2] = b;
+		dst[3] = src[3];
+	}
+}
+
+static bool IsOpaqueScalar( const unsigned char* src, int count )
+{
+	unsigned char acc = 255;
+	for( int i = 0; i < count; ++i )
+		acc &= src[i * 4 + 3];
+	return acc == 255;
+}
+
+static inline void HashChunk( const unsigned char* chunk, uint64 index,
+	uint64 acc[2] )
+{
+	uint64 data[2];
+	memcpy( data, chunk, 16 );
+	for( int j = 0; j < 2; ++j )
+	{
+		uint64 key = data[j] ^ ( HASH_KEY[j] + index * HASH_STEP[j] );
+		acc[j] += ( key & 0xffffffffULL ) * ( key >> 32 ) + data[1 - j];
+	}
+}
+
+static void HashScalar( const unsigned char* src, int count, uint64 index,
+	uint64 acc[2] )
+{
+	int i = 0;
+	for( ; i + 4 <= count; i += 4, src += 16, ++index )
+		HashChunk( src, index, acc );
+
+	// The rest is padded with zeros.
+	if( i < count )
+	{
+		unsigned char chunk[16] = { 0 };
+		memcpy( chunk, src, ( count - i ) * 4 );
+		HashChunk( chunk, index, acc );
+	}
+}
+
+#ifdef PIXELKERNELS_X86
+
+///****************************************************************
+// SSE2, 4 pixels at a time
+
+TARGET_SSE2
+static inline __m128 UnpremultiplyPixelSSE2( __m128 p )
+{
+	const __m128 one = _mm_set1_ps( 1.0f );
+	const __m128 max = _mm_set1_ps( 255.0f );
+	const __m128 half = _mm_set1_ps( 0.5f );
+	const __m128 alphalane = _mm_castsi128_ps( _mm_set_epi32( -1, 0, 0, 0 ) );
+
+	__m128 a = _mm_max_ps( _mm_shuffle_ps( p, p, 0xFF ), one );
+	__m128 r = _mm_add_ps( _mm_mul_ps( p, _mm_div_ps( max, a ) ), half );
+	return _mm_or_ps( _mm_and_ps( alphalane, p ), _mm_andnot_ps( alphalane, r ) );
+}
+
+TARGET_SSE2
+static void UnpremultiplySSE2( const unsigned char* src, unsigned char* dst,
+	int count )
+{
+	const __m128i alpha = _mm_set1_epi32( (int)0xFF000000 );
+	const __m128i zero = _mm_setzero_si128();
+
+	int i = 0;
+	for( ; i + 4 <= count; i += 4, src += 16, dst += 16 )
+	{
+		__m128i v = _mm_loadu_si128( (const __m128i*)src );
+		if( _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_and_si128( v, alpha ),
+			alpha ) ) == 0xFFFF )
+		{
+			_mm_storeu_si128( (__m128i*)dst, v );
+			continue;
+		}
+
+		__m128i lo = _mm_unpacklo_epi8( v, zero );
+		__m128i hi = _mm_unpackhi_epi8( v, zero );
+		__m128i p0 = _mm_cvttps_epi32( UnpremultiplyPixelSSE2(
+			_mm_cvtepi32_ps( _mm_unpacklo_epi16( lo, zero ) ) ) );
+		__m128i p1 = _mm_cvttps_epi32( UnpremultiplyPixelSSE2(
+			_mm_cvtepi32_ps( _mm_unpackhi_epi16( lo, zero ) ) ) );
+		__m128i p2 = _mm_cvttps_epi32( UnpremultiplyPixelSSE2(
+			_mm_cvtepi32_ps( _mm_unpacklo_epi16( hi, zero ) ) ) );
+		__m128i p3 = _mm_cvttps_epi32( UnpremultiplyPixelSSE2(
+			_mm_cvtepi32_ps( _mm_unpackhi_epi16( hi, zero ) ) ) );
+		_mm_storeu_si128( (__m128i*)dst, _mm_packus_epi16(
+			_mm_packs_epi32( p0, p1 ), _mm_packs_epi32( p2, p3 ) ) );
+	}
+	UnpremultiplyScalar( src, dst, count - i );
+}
+
+TARGET_SSE2
+static inline __m128i PremultiplyHalfSSE2( __m128i v )
+{
+	const __m128i round = _mm_set1_epi16( 128 );
+	const __m128i alphamask = _mm_set_epi16( -1, 0, 0, 0, -1, 0, 0, 0 );
+
+	__m128i a = _mm_shufflehi_epi16( _mm_shufflelo_epi16( v, 0xFF ), 0xFF );
+	__m128i t = _mm_add_epi16( _mm_mullo_epi16( v, a ), round );
+	t = _mm_srli_epi16( _mm_add_epi16( t, _mm_srli_epi16( t, 8 ) ), 8 );
+	return _mm_or_si128( _mm_and_si128( alphamask, v ),
+		_mm_andnot_si128( alphamask, t ) );
+}
+
+TARGET_SSE2
+static void PremultiplySSE2( const unsigned char* src, unsigned char* dst,
+	int count )
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	int i = 0;
+	for( ; i + 4 <= count; i += 4, src += 16, dst += 16 )
+	{
+		__m128i v = _mm_loadu_si128( (const __m128i*)src );
+		__m128i lo = PremultiplyHalfSSE2( _mm_unpacklo_epi8( v, zero ) );
+		__m128i hi = PremultiplyHalfSSE2( _mm_unpackhi_epi8( v, zero ) );
+		_mm_storeu_si128( (__m128i*)dst, _mm_packus_epi16( lo, hi ) );
+	}
+	PremultiplyScalar( src, dst, count - i );
+}
+
+TARGET_SSE2
+static void SwizzleRBSSE2( const unsigned char* src, unsigned char* dst,
+	int count )
+{
+	const __m128i keep = _mm_set1_epi32( (int)0xFF00FF00 );
+	const __m128i low = _mm_set1_epi32( 0x000000FF );
+
+	int i = 0;
+	for( ; i + 4 <= count; i += 4, src += 16, dst += 16 )
+	{
+		__m128i v = _mm_loadu_si128( (const __m128i*)src );
+		__m128i b = _mm_slli_epi32( _mm_and_si128( v, low ), 16 );
+		__m128i r = _mm_and_si128( _mm_srli_epi32( v, 16 ), low );
+		_mm_storeu_si128( (__m128i*)dst,
+			_mm_or_si128( _mm_and_si128( v, keep ), _mm_or_si128( b, r ) ) );
+	}
+	SwizzleRBScalar( src, dst, count - i );
+}
+
+TARGET_SSE2
+static bool IsOpaqueSSE2( const unsigned char* src, int count )
+{
+	const __m128i alpha = _mm_set1_epi32( (int)0xFF000000 );
+
+	__m128i acc = alpha;
+	int i = 0;
+	for( ; i + 4 <= count; i += 4, src += 16 )
+		acc = _mm_and_si128( acc, _mm_loadu_si128( (const __m128i*)src ) );
+
+	acc = _mm_cmpeq_epi8( _mm_and_si128( acc, alpha ), alpha );
+	return _mm_movemask_epi8( acc ) == 0xFFFF &&
+		IsOpaqueScalar( src, count - i );
+}
+
+TARGET_SSE2
+static void HashSSE2( const unsigned char* src, int count, uint64 index,
+	uint64 acc[2] )
+{
+	__m128i sum = _mm_loadu_si128( (const __m128i*)acc );
+	__m128i key = _mm_set_epi64x( (long long)( HASH_KEY[1] + index * HASH_STEP[1] ),
+		(long long)( HASH_KEY[0] + index * HASH_STEP[0] ) );
+	const __m128i step = _mm_set_epi64x( (long long)HASH_STEP[1],
+		(long long)HASH_STEP[0] );
+
+	int i = 0;
+	for( ; i + 4 <= count; i += 4, src += 16, ++index )
+	{
+		__m128i data = _mm_loadu_si128( (const __m128i*)src );
+		__m128i datakey = _mm_xor_si128( data, key );
+		__m128i product = _mm_mul_epu32( datakey,
+			_mm_shuffle_epi32( datakey, _MM_SHUFFLE( 0, 3, 0, 1 ) ) );
+		sum = _mm_add_epi64( sum, _mm_add_epi64( product,
+			_mm_shuffle_epi32( data, _MM_SHUFFLE( 1, 0, 3, 2 ) ) ) );
+		key = _mm_add_epi64( key, step );
+	}
+	_mm_storeu_si128( (__m128i*)acc, sum );
+	HashScalar( src, count - i, index, acc );
+}
+
+///****************************************************************
+// AVX2, 8 pixels at a time. Unpacking and packing both work within
+// 128 bit lanes, so pixel order comes out right.
+
+TARGET_AVX2
+static inline __m256 UnpremultiplyPixelsAVX2( __m256 p )
+{
+	const __m256 one = _mm256_set1_ps( 1.0f );
+	const __m256 max = _mm256_set1_ps( 255.0f );
+	const __m256 half = _mm256_set1_ps( 0.5f );
+	const __m256 alphalane = _mm256_castsi256_ps(
+		_mm256_set_epi32( -1, 0, 0, 0, -1, 0, 0, 0 ) );
+
+	__m256 a = _mm256_max_ps( _mm256_shuffle_ps( p, p, 0xFF ), one );
+	__m256 r = _mm256_add_ps( _mm256_mul_ps( p, _mm256_div_ps( max, a ) ), half );
+	return _mm256_blendv_ps( r, p, alphalane );
+}
+
+TARGET_AVX2
+static void UnpremultiplyAVX2( const unsigned char* src, unsigned char* dst,
+	int count )
+{
+	const __m256i alpha = _mm256_set1_epi32( (int)0xFF000000 );
+	const __m256i zero = _mm256_setzero_si256();
+
+	int i = 0;
+	for( ; i + 8 <= count; i += 8, src += 32, dst += 32 )
+	{
+		__m256i v = _mm256_loadu_si256( (const __m256i*)src );
+		if( _mm256_movemask_epi8( _mm256_cmpeq_epi8(
+			_mm256_and_si256( v, alpha ), alpha ) ) == -1 )
+		{
+			_mm256_storeu_si256( (__m256i*)dst, v );
+			continue;
+		}
+
+		__m256i lo = _mm256_unpacklo_epi8( v, zero );
+		__m256i hi = _mm256_unpackhi_epi8( v, zero );
+		__m256i p0 = _mm256_cvttps_epi32( UnpremultiplyPixelsAVX2(
+			_mm256_cvtepi32_ps( _mm256_unpacklo_epi16( lo, zero ) ) ) );
+		__m256i p1 = _mm256_cvttps_epi32( UnpremultiplyPixelsAVX2(
+			_mm256_cvtepi32_ps( _mm256_unpackhi_epi16( lo, zero ) ) ) );
+		__m256i p2 = _mm256_cvttps_epi32( UnpremultiplyPixelsAVX2(
+			_mm256_cvtepi32_ps( _mm256_unpacklo_epi16( hi, zero ) ) ) );
+		__m256i p3 = _mm256_cvttps_epi32( UnpremultiplyPixelsAVX2(
+			_mm256_cvtepi32_ps( _mm256_unpackhi_epi16( hi, zero ) ) ) );
+		_mm256_storeu_si256( (__m256i*)dst, _mm256_packus_epi16(
+			_mm256_packs_epi32( p0, p1 ), _mm256_packs_epi32( p2, p3 ) ) );
+	}
+	UnpremultiplySSE2( src, dst, count - i );
+}
+
+TARGET_AVX2
+static inline __m256i PremultiplyHalfAVX2( __m256i v )
+{
+	const __m256i round = _mm256_set1_epi16( 128 );
+	const __m256i alphamask = _mm256_set_epi16( -1, 0, 0, 0, -1, 0, 0, 0,
+		-1, 0, 0, 0, -1, 0, 0, 0 );
+
+	__m256i a = _mm256_shufflehi_epi16( _mm256_shufflelo_epi16( v, 0xFF ), 0xFF );
+	__m256i t = _mm256_add_epi16( _mm256_mullo_epi16( v, a ), round );
+	t = _mm256_srli_epi16( _mm256_add_epi16( t, _mm256_srli_epi16( t, 8 ) ), 8 );
+	return _mm256_blendv_epi8( t, v, alphamask );
+}
+
+TARGET_AVX2
+static void PremultiplyAVX2( const unsigned char* src, unsigned char* dst,
+	int count )
+{
+	const __m256i zero = _mm256_setzero_si256();
+
+	int i = 0;
+	for( ; i + 8 <= count; i += 8, src += 32, dst += 32 )
+	{
+		__m256i v = _mm256_loadu_si256( (const __m256i*)src );
+		__m256i lo = PremultiplyHalfAVX2( _mm256_unpacklo_epi8( v, zero ) );
+		__m256i hi = PremultiplyHalfAVX2( _mm256_unpackhi_epi8( v, zero ) );
+		_mm256_storeu_si256( (__m256i*)dst, _mm256_packus_epi16( lo, hi ) );
+	}
+	PremultiplySSE2( src, dst, count - i );
+}
+
+TARGET_AVX2
+static void SwizzleRBAVX2( const unsigned char* src, unsigned char* dst,
+	int count )
+{
+	const __m256i order = _mm256_setr_epi8(
+		2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+		2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15 );
+
+	int i = 0;
+	for( ; i + 8 <= count; i += 8, src += 32, dst += 32 )
+	{
+		__m256i v = _mm256_loadu_si256( (const __m256i*)src );
+		_mm256_storeu_si256( (__m256i*)dst, _mm256_shuffle_epi8( v, order ) );
+	}
+	SwizzleRBSSE2( src, dst, count - i );
+}
+
+TARGET_AVX2
+static bool IsOpaqueAVX2( const unsigned char* src, int count )
+{
+	const __m256i alpha = _mm256_set1_epi32( (int)0xFF000000 );
+
+	__m256i acc = alpha;
+	int i = 0;
+	for( ; i + 8 <= count; i += 8, src += 32 )
+		acc = _mm256_and_si256( acc, _mm256_loadu_si256( (const __m256i*)src ) );
+
+	acc = _mm256_cmpeq_epi8( _mm256_and_si256( acc, alpha ), alpha );
+	return _mm256_movemask_epi8( acc ) == -1 &&
+		IsOpaqueSSE2( src, count - i );
+}
+
+TARGET_AVX2
+static void HashAVX2( const unsigned char* src, int count, uint64 index,
+	uint64 acc[2] )
+{
+	// Even chunks in the low lane, odd ones in the high lane.
+	__m256i sum = _mm256_setzero_si256();
+	__m256i key = _mm256_set_epi64x(
+		(long long)( HASH_KEY[1] + ( index + 1 ) * HASH_STEP[1] ),
+		(long long)( HASH_KEY[0] + ( index + 1 ) * HASH_STEP[0] ),
+		(long long)( HASH_KEY[1] + index * HASH_STEP[1] ),
+		(long long)( HASH_KEY[0] + index * HASH_STEP[0] ) );
+	const __m256i step = _mm256_set_epi64x( (long long)( HASH_STEP[1] * 2 ),
+		(long long)( HASH_STEP[0] * 2 ), (long long)( HASH_STEP[1] * 2 ),
+		(long long)( HASH_STEP[0] * 2 ) );
+
+	int i = 0;
+	for( ; i + 8 <= count; i += 8, src += 32, index += 2 )
+	{
+		__m256i data = _mm256_loadu_si256( (const __m256i*)src );
+		__m256i datakey = _mm256_xor_si256( data, key );
+		__m256i product = _mm256_mul_epu32( datakey,
+			_mm256_shuffle_epi32( datakey, _MM_SHUFFLE( 0, 3, 0, 1 ) ) );
+		sum = _mm256_add_epi64( sum, _mm256_add_epi64( product,
+			_mm256_shuffle_epi32( data, _MM_SHUFFLE( 1, 0, 3, 2 ) ) ) );
+		key = _mm256_add_epi64( key, step );
+	}
+
+	__m128i folded = _mm_add_epi64( _mm256_castsi256_si128( sum ),
+		_mm256_extracti128_si256( sum, 1 ) );
+	__m128i total = _mm_add_epi64( folded, _mm_loadu_si128( (const __m128i*)acc ) );
+	_mm_storeu_si128( (__m128i*)acc, total );
+	HashSSE2( src, count - i, index, acc );
+}
+
+static PixelKernels::Level DetectLevel()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid( info, 0 );
+	int maxleaf = info[0];
+
+	__cpuid( info, 1 );
+	bool sse2 = ( info[3] & ( 1 << 26 ) ) != 0;
+	bool osxsave = ( info[2] & ( 1 << 27 ) ) != 0;
+	bool avx = ( info[2] & ( 1 << 28 ) ) != 0;
+	bool avx2 = false;
+	if( maxleaf >= 7 && osxsave && avx )
+	{
+		// The OS must save the YMM registers too.
+		bool ymm = ( _xgetbv( 0 ) & 6 ) == 6;
+		__cpuidex( info, 7, 0 );
+		avx2 = ymm && ( info[1] & ( 1 << 5 ) ) != 0;
+	}
+#else
+	__builtin_cpu_init();
+	bool sse2 = __builtin_cpu_supports( "sse2" );
+	bool avx2 = __builtin_cpu_supports( "avx2" );
+#endif
+
+	if( avx2 )
+		return PixelKernels::AVX2;
+	if( sse2 )
+		return PixelKernels::SSE2;
+	return PixelKernels::SCALAR;
+}
+
+#else
+
+static PixelKernels::Level DetectLevel()
+{
+	return PixelKernels::SCALAR;
+}
+
+#endif // PIXELKERNELS_X86
+
+///****************************************************************
+// Dispatch
+
+struct KernelTable
+{
+	PixelKernels::RowFunc mPremultiply;
+	PixelKernels::RowFunc mUnpremultiply;
+	PixelKernels::RowFunc mSwizzleRB;
+	bool (*mIsOpaque)( const unsigned char* src, int count );
+	void (*mHash)( const unsigned char* src, int count, uint64 index,
+		uint64 acc[2] );
+};
+
+static const KernelTable s_Kernels[] =
+{
+	{ PremultiplyScalar, UnpremultiplyScalar, SwizzleRBScalar, IsOpaqueScalar,
+		HashScalar },
+#ifdef PIXELKERNELS_X86
+	{ PremultiplySSE2, UnpremultiplySSE2, SwizzleRBSSE2, IsOpaqueSSE2,
+		HashSSE2 },
+	{ PremultiplyAVX2, UnpremultiplyAVX2, SwizzleRBAVX2, IsOpaqueAVX2,
+		HashAVX2 },
+#endif
+};
+
+static PixelKernels::Level s_SupportedLevel = DetectLevel();
+static PixelKernels::Level s_Level = s_SupportedLevel;
+
+PixelKernels::Level PixelKernels::GetSupportedLevel()
+{
+	return s_SupportedLevel;
+}
+
+PixelKernels::Level PixelKernels::GetLevel()
+{
+	return s_Level;
+}
+
+void PixelKernels::SetLevel( Level level )
+{
+	s_Level = level < s_SupportedLevel ? level : s_SupportedLevel;
+}
+
+const char* PixelKernels::GetLevelName( Level level )
+{
+	switch( level )
+	{
+	case AVX2:
+		return "avx2";
+	case SSE2:
+		return "sse2";
+	default:
+		return "scalar";
+	}
+}
+
+void PixelKernels::Premultiply( const unsigned char* src, unsigned char* dst,
+	int count )
+{
+	s_Kernels[s_Level].mPremultiply( src, dst, count );
+}
+
+void PixelKernels::Unpremultiply( const unsigned char* src, unsigned char* dst,
+	int count )
+{
+	s_Kernels[s_Level].mUnpremultiply( src, dst, count );
+}
+
+void PixelKernels::SwizzleRB( const unsigned char* src, unsigned char* dst,
+	int count )
+{
+	s_Kernels[s_Level].mSwizzleRB( src, dst, count );
+}
+
+bool PixelKernels::IsOpaque( const unsigned char* src, int count )
+{
+	return s_Kernels[s_Level].mIsOpaque( src, count );
+}
+
+void PixelKernels::HashAccumulate( const unsigned char* src, int count,
+	unsigned long long index, unsigned long long acc[2] )
+{
+	s_Kernels[s_Level].mHash( src, count, index, acc );
+}
+
+unsigned long long PixelKernels::HashFinish( const unsigned long long acc[2] )
+{
+	// Murmur3 finalizer over both lanes.
+	uint64 h = acc[0] ^ ( ( acc[1] << 31 ) | ( acc[1] >> 33 ) );
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb93fe1a85ec1ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+} // namespace avg
@@ -0,0 +1,56 @@
+#ifndef PIXELKERNELS_H
+#define PIXELKERNELS_H
+
+namespace avg
+{
+
+/*! \brief Per-pixel kernels for 4 byte BGRA rows, with SSE2 and AVX2
+ * versions picked at runtime. All of them take src and dst rows of count
+ * pixels. src and dst may be the same row. */
+class PixelKernels
+{
+public:
+	typedef void (*RowFunc)( const unsigned char* src, unsigned char* dst,
+		int count );
+
+	enum Level
+	{
+		SCALAR,
+		SSE2,
+		AVX2
+	};
+
+	/*! \brief Best level this CPU supports. */
+	static Level GetSupportedLevel();
+	/*! \brief Level in use, the supported one unless changed. */
+	static Level GetLevel();
+	/*! \brief Forces a level, capped to the supported one. For benchmarks. */
+	static void SetLevel( Level level );
+	static const char* GetLevelName( Level level );
+
+	/*! \brief Converts straight to premultiplied alpha. */
+	static void Premultiply( const unsigned char* src, unsigned char* dst,
+		int count );
+	/*! \brief Converts premultiplied to straight alpha, as libavg blends
+	 * B8G8R8A8 with straight alpha. Opaque pixels are copied as they are. */
+	static void Unpremultiply( const unsigned char* src, unsigned char* dst,
+		int count );
+	/*! \brief Swaps the B and R channels, BGRA <-> RGBA. */
+	static void SwizzleRB( const unsigned char* src, unsigned char* dst,
+		int count );
+	/*! \brief True if every pixel has alpha 255. */
+	static bool IsOpaque( const unsigned char* src, int count );
+
+	/*! \brief Adds count pixels to a 128 bit hash state.
+	 * index is the position of src in 4 pixel steps, so equal content at
+	 * another position hashes differently. Continue with index +
+	 * ( count + 3 ) / 4. The result is the same for every level. */
+	static void HashAccumulate( const unsigned char* src, int count,
+		unsigned long long index, unsigned long long acc[2] );
+	/*! \brief Folds a hash state into the final 64 bit hash. */
+	static unsigned long long HashFinish( const unsigned long long acc[2] );
+};
+
+} // namespace avg
+
+#endif
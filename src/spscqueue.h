@@ -0,0 +1,59 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <atomic>
+#include <vector>
+
+namespace avg
+{
+
+/*! \brief Bounded lock-free queue for exactly one producer and one
+ * consumer thread. Capacity is rounded up to a power of two. */
+template< class T >
+class SPSCQueue
+{
+public:
+	explicit SPSCQueue( size_t capacity ) : mHead( 0 ), mTail( 0 )
+	{
+		size_t size = 1;
+		while( size < capacity )
+			size *= 2;
+		mItems.resize( size );
+		mMask = size - 1;
+	}
+
+	/*! \brief Producer side. Returns false if the queue is full. */
+	bool Push( const T& item )
+	{
+		size_t tail = mTail.load( std::memory_order_relaxed );
+		if( tail - mHead.load( std::memory_order_acquire ) > mMask )
+			return false;
+
+		mItems[tail & mMask] = item;
+		mTail.store( tail + 1, std::memory_order_release );
+		return true;
+	}
+
+	/*! \brief Consumer side. Returns false if the queue is empty. */
+	bool Pop( T& item )
+	{
+		size_t head = mHead.load( std::memory_order_relaxed );
+		if( head == mTail.load( std::memory_order_acquire ) )
+			return false;
+
+		item = mItems[head & mMask];
+		mItems[head & mMask] = T();
+		mHead.store( head + 1, std::memory_order_release );
+		return true;
+	}
+
+private:
+	std::vector< T > mItems;
+	size_t mMask;
+	std::atomic< size_t > mHead;
+	std::atomic< size_t > mTail;
+};
+
+} // namespace avg
+
+#endif
@@ -0,0 +1,101 @@
+#include "surfacepool.h"
+
+#include <iterator>
+
+namespace avg
+{
+
+SurfacePool::SurfacePool()
+	: mMaxTextures( 0 ), mMaxBitmaps( 0 ), mTextureHits( 0 ), mBitmapHits( 0 )
+{}
+
+SurfacePool& SurfacePool::Get()
+{
+	static SurfacePool pool;
+	return pool;
+}
+
+void SurfacePool::SetLimits( int maxtextures, int maxbitmaps )
+{
+	mMaxTextures = maxtextures;
+	mMaxBitmaps = maxbitmaps;
+	while( (int)mTextures.size() > mMaxTextures )
+		mTextures.pop_front();
+	while( (int)mBitmaps.size() > mMaxBitmaps )
+		mBitmaps.pop_front();
+}
+
+template< class T >
+T SurfacePool::Take( std::list< Entry< T > >& entries, const IntPoint& size,
+	PixelFormat pf )
+{
+	// Newest first, its memory is most likely still warm.
+	for( auto i = entries.rbegin(); i != entries.rend(); ++i )
+	{
+		if( i->mSize == size && i->mPF == pf )
+		{
+			T ptr = i->mPtr;
+			entries.erase( std::next( i ).base() );
+			return ptr;
+		}
+	}
+	return T();
+}
+
+template< class T >
+void SurfacePool::Put( std::list< Entry< T > >& entries, const IntPoint& size,
+	PixelFormat pf, T ptr, int limit )
+{
+	if( limit <= 0 )
+		return;
+
+	Entry< T > entry = { size, pf, ptr };
+	entries.push_back( entry );
+	while( (int)entries.size() > limit )
+		entries.pop_front();
+}
+
+MCTexturePtr SurfacePool::AcquireTexture( const IntPoint& size, PixelFormat pf )
+{
+	MCTexturePtr texture = Take( mTextures, size, pf );
+	if( texture )
+	{
+		++mTextureHits;
+		return texture;
+	}
+	return GLContextManager::get()->createTexture( size, pf, false );
+}
+
+void SurfacePool::ReleaseTexture( MCTexturePtr texture )
+{
+	if( texture )
+		Put( mTextures, texture->getSize(), texture->getPF(), texture, mMaxTextures );
+}
+
+BitmapPtr SurfacePool::AcquireBitmap( const IntPoint& size, PixelFormat pf )
+{
+	BitmapPtr bitmap = Take( mBitmaps, size, pf );
+	if( bitmap )
+	{
+		++mBitmapHits;
+		return bitmap;
+	}
+	return BitmapPtr( new Bitmap( glm::vec2( (float)size.x, (float)size.y ), pf ) );
+}
+
+void SurfacePool::ReleaseBitmap( BitmapPtr bitmap )
+{
+	if( bitmap )
+	{
+		Put( mBitmaps, bitmap->getSize(), bitmap->getPixelFormat(), bitmap,
+			mMaxBitmaps );
+	}
+}
+
+void SurfacePool::Clear()
+{
+	mTextures.clear();
+	mBitmaps.clear();
+}
+
+} // namespace avg
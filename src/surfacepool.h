@@ -0,0 +1,68 @@
+#ifndef SURFACEPOOL_H
+#define SURFACEPOOL_H
+
+#include <list>
+
+#include <graphics/Bitmap.h>
+#include <graphics/GLContextManager.h>
+#include <graphics/MCTexture.h>
+
+namespace avg
+{
+
+/*! \brief Process-wide pool of textures and bitmaps of disconnected nodes.
+ * New nodes take storage of matching size and pixel format from here
+ * instead of allocating it, which avoids allocation churn and driver
+ * stalls when nodes are recreated all the time. Only used from the main
+ * thread. Oldest entries are dropped once a limit is reached. */
+class SurfacePool
+{
+public:
+	static SurfacePool& Get();
+
+	void SetLimits( int maxtextures, int maxbitmaps );
+
+	/*! \brief Returns a pooled texture or creates a new one. */
+	MCTexturePtr AcquireTexture( const IntPoint& size, PixelFormat pf );
+	void ReleaseTexture( MCTexturePtr texture );
+
+	/*! \brief Returns a pooled bitmap or creates a new one.
+	 * Contents are undefined. */
+	BitmapPtr AcquireBitmap( const IntPoint& size, PixelFormat pf );
+	void ReleaseBitmap( BitmapPtr bitmap );
+
+	/*! \brief Drops everything. Must happen while GL is still alive. */
+	void Clear();
+
+	int GetTextureHits() const { return mTextureHits; }
+	int GetBitmapHits() const { return mBitmapHits; }
+
+private:
+	template< class T >
+	struct Entry
+	{
+		IntPoint mSize;
+		PixelFormat mPF;
+		T mPtr;
+	};
+
+	template< class T >
+	static T Take( std::list< Entry< T > >& entries, const IntPoint& size,
+		PixelFormat pf );
+	template< class T >
+	static void Put( std::list< Entry< T > >& entries, const IntPoint& size,
+		PixelFormat pf, T ptr, int limit );
+
+	SurfacePool();
+
+	std::list< Entry< MCTexturePtr > > mTextures;
+	std::list< Entry< BitmapPtr > > mBitmaps;
+	int mMaxTextures;
+	int mMaxBitmaps;
+	int mTextureHits;
+	int mBitmapHits;
+};
+
+} // namespace avg
+
+#endif
@@ -0,0 +1,82 @@
+#include "tilediff.h"
+
+#include <algorithm>
+
+#include "pixelkernels.h"
+
+namespace avg
+{
+
+TileDiff::TileDiff() : mWidth( 0 ), mHeight( 0 ), mCols( 0 ), mRows( 0 )
+{}
+
+void TileDiff::Reset()
+{
+	std::fill( mKnown.begin(), mKnown.end(), false );
+}
+
+unsigned long long TileDiff::HashTile( const unsigned char* src, int stride,
+	const CefRect& tile ) const
+{
+	unsigned long long acc[2] = { 0, 0 };
+	// Rows continue the position index, so content moving between rows
+	// changes the hash too.
+	unsigned long long rowchunks = ( TILE_SIZE + 3 ) / 4;
+	src += tile.y * stride + tile.x * 4;
+	for( int y = 0; y < tile.height; ++y, src += stride )
+		PixelKernels::HashAccumulate( src, tile.width, y * rowchunks, acc );
+	return PixelKernels::HashFinish( acc );
+}
+
+void TileDiff::Refine( const unsigned char* src, int stride, int width,
+	int height, const DirtyRegion& reported, DirtyRegion& changed )
+{
+	changed.SetBounds( width, height );
+
+	if( width != mWidth || height != mHeight )
+	{
+		mWidth = width;
+		mHeight = height;
+		mCols = ( width + TILE_SIZE - 1 ) / TILE_SIZE;
+		mRows = ( height + TILE_SIZE - 1 ) / TILE_SIZE;
+		mHashes.assign( mCols * mRows, 0 );
+		mKnown.assign( mCols * mRows, false );
+	}
+	mTouched.assign( mCols * mRows, false );
+
+	const std::vector< CefRect >& rects = reported.GetRects();
+	for( auto i = rects.begin(); i != rects.end(); ++i )
+	{
+		int x1 = std::min( ( i->x + i->width - 1 ) / TILE_SIZE, mCols - 1 );
+		int y1 = std::min( ( i->y + i->height - 1 ) / TILE_SIZE, mRows - 1 );
+		for( int ty = i->y / TILE_SIZE; ty <= y1; ++ty )
+		{
+			for( int tx = i->x / TILE_SIZE; tx <= x1; ++tx )
+				mTouched[ty * mCols + tx] = true;
+		}
+	}
+
+	for( int ty = 0; ty < mRows; ++ty )
+	{
+		for( int tx = 0; tx < mCols; ++tx )
+		{
+			int index = ty * mCols + tx;
+			if( !mTouched[index] )
+				continue;
+
+			CefRect tile( tx * TILE_SIZE, ty * TILE_SIZE,
+				std::min( TILE_SIZE, width - tx * TILE_SIZE ),
+				std::min( TILE_SIZE, height - ty * TILE_SIZE ) );
+			unsigned long long hash = HashTile( src, stride, tile );
+			if( mKnown[index] && mHashes[index] == hash )
+				continue;
+
+			mHashes[index] = hash;
+			mKnown[index] = true;
+			changed.Add( reported, tile );
+		}
+	}
+	changed.Optimize();
+}
+
+} // namespace avg
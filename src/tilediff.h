@@ -0,0 +1,47 @@
+#ifndef TILEDIFF_H
+#define TILEDIFF_H
+
+#include <vector>
+
+#include "dirtyregion.h"
+
+namespace avg
+{
+
+/*! \brief Finds the parts of a reported dirty region that really changed.
+ * The frame is split into TILE_SIZE tiles. Every reported tile is hashed
+ * and compared with its hash from the last frame, only tiles whose hash
+ * changed are kept. Needs full frames as source, as CEF's OnPaint gives.
+ * Must be reset whenever the destination changes behind its back. */
+class TileDiff
+{
+public:
+	static const int TILE_SIZE = 64;
+
+	TileDiff();
+
+	/*! \brief Forgets all hashes, so every tile counts as changed. */
+	void Reset();
+
+	/*! \brief Sets changed to the parts of reported in tiles whose content
+	 * changed. src is the full frame of width * height pixels. */
+	void Refine( const unsigned char* src, int stride, int width, int height,
+		const DirtyRegion& reported, DirtyRegion& changed );
+
+private:
+	unsigned long long HashTile( const unsigned char* src, int stride,
+		const CefRect& tile ) const;
+
+	int mWidth;
+	int mHeight;
+	int mCols;
+	int mRows;
+	std::vector< unsigned long long > mHashes;
+	std::vector< bool > mKnown;
+	// Scratch, marks the tiles touched by the reported region.
+	std::vector< bool > mTouched;
+};
+
+} // namespace avg
+
+#endif